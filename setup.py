@@ -6,10 +6,19 @@ except ImportError:
 
 import numpy as np
 
-if sys.platform != 'win32':
-    compile_args = ['-funroll-loops']
+# The noise kernel is parallelised with OpenMP where the compiler supports
+# it.  Apple's clang does not ship OpenMP, so there it runs single-threaded.
+# Floating point contraction is disabled so that the SIMD kernels give
+# bit-for-bit the same output as the scalar kernel.
+if sys.platform == 'win32':
+    compile_args = ['/openmp']
+    link_args = []
+elif sys.platform == 'darwin':
+    compile_args = ['-funroll-loops', '-ffp-contract=off']
+    link_args = []
 else:
-    compile_args = []
+    compile_args = ['-funroll-loops', '-ffp-contract=off', '-fopenmp']
+    link_args = ['-fopenmp']
 
 with open("README.md", "r") as f:
     long_desc = f.read()
@@ -36,10 +45,12 @@ setup(
         'Topic :: Scientific/Engineering',
     ],
     install_requires = ['numpy', 'imageio', 'imageio-ffmpeg', 'tqdm'],
+    extras_require = {'gpu': ['cupy']},
     packages=['zebranoise'],
     ext_modules=[
         Extension('zebranoise._perlin', ['zebranoise/_perlin.c'],
             extra_compile_args=compile_args,
+            extra_link_args=link_args,
                   include_dirs=[np.get_include()],
         )
     ],
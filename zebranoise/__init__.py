@@ -1,5 +1,6 @@
-from .perlin_stimulus import PerlinStimulus
-from .util import generate_frames
-from .easy import zebra_noise
+from .perlin_stimulus import PerlinStimulus, generate_stimuli
+from .util import generate_frames, generate_frames_batch, tiles
+from .easy import zebra_noise, zebra_noise_async, zebra_noise_realtime
+from .jobs import Job, Cancelled
 
 Perl = PerlinStimulus # Backward compatibility
@@ -5,8 +5,18 @@
 #include "Python.h"
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
 #define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
 #include <numpy/arrayobject.h>
+#ifdef _OPENMP
+#include <omp.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 
 #ifdef _MSC_VER
 #define inline __inline
@@ -105,135 +115,2830 @@ noise3(float x, float y, float z, const int repeatx, const int repeaty, const in
 									  grad3(PERM[BB + kk], x - 1, y - 1, z - 1))));
 }
 
-static PyObject *
-make_perlin(PyObject *self, PyObject *args, PyObject *kwargs)
+typedef struct {
+	int octaves;
+	float persistence;
+	float lacunarity;
+	int repeatx, repeaty, repeatz;
+	int base;
+	int fixed;      // Use the fixed-point kernels, see FIXED_SHIFT
+} perlin_params;
+
+// Memory layouts of the output.  LAYOUT_XYZ is ret[i][j][k] with the z
+// (time) axis innermost.  LAYOUT_ZYX is ret[k][j][i], i.e. one contiguous
+// (y,x) frame per z value.
+enum { LAYOUT_XYZ, LAYOUT_ZYX };
+
+// Everything noise3 computes from a single coordinate, for each position
+// along one axis of the grid at one octave.
+typedef struct {
+	int *lo;   // Lattice cell, offset by base.  Already hashed through PERM for x.
+	int *hi;   // The next cell, wrapped at the repeat period.  Likewise.
+	float *t;  // Position within the cell
+	float *f;  // Fade curve of t
+	short *tq; // t and f in fixed point, for fixed-point lattices only
+	short *fq;
+	int *cell;  // Also for fixed point: the runs of positions in the same
+	int *first; // cell, numbered from 0, and the first position of each
+	int ncells;
+} lattice_axis;
+
+// Per-axis lattice tables for every octave of a tensor-product grid.  Since
+// the noise is only ever evaluated on such grids, this leaves hashing and
+// blending as the only per-sample work.  In particular the repeat periods
+// only enter through the wrapped hi cells, so there is no modulo left in the
+// row kernels, and their octave loop runs once per row rather than once per
+// sample.  AVX-512 kernels specialised for 4 or 8 octaves (unrolled, with
+// either loop order) gave identical output but were 0-6% slower than these
+// on 640x480 and 1920x1080 frames, so there are none.
+typedef struct {
+	int len_x, len_y, len_z;
+	int levels;     // Number of octaves before the amplitude becomes negligible
+	int single;     // With one octave, noise3 is returned without normalisation
+	float *amp;     // Amplitude of each octave
+	float max;      // Sum of the amplitudes
+	int fixed;      // Evaluate with the fixed-point kernels
+	int *weight;    // amp/max of each octave in Q0.15, for fixed point
+	lattice_axis *x, *y, *z;
+	void *mem;
+} perlin_lattice;
+
+// The fixed-point kernels compute noise3 in 16-bit integers, with
+// positions within a cell, gradients and noise values in Q2.13 (value *
+// FIXED_ONE) and the fade curves and octave weights in Q0.15.  Every
+// gradient component is 0 or +-1, so the dot products are only additions
+// and subtractions, and each lerp is a single rounding multiply.  The
+// octaves are summed with weights amp/max, so no division is needed.
+//
+// The quantised t and f are within 2^-14 and 2^-16 of the float values,
+// each lerp rounds to within 2^-14, and an error of e in f moves a lerp by
+// at most 4e.  Through the three lerps of noise3 and the weighted sum this
+// bounds the difference from the float kernels at (6 + levels/2) * 2^-13,
+// i.e. below 1.4e-3 for 10 octaves, or 0.18 grey levels of uint8 output
+// covering [-1,1].  The measured maximum is under half of that.  Values never
+// leave [-2,2], so no intermediate overflows int16.
+#define FIXED_SHIFT 13
+#define FIXED_ONE (1 << FIXED_SHIFT)
+
+static void
+lattice_axis_fill(lattice_axis *a, const float *v, const int n, const float freq,
+	const int repeat, const int base, const int hash)
 {
-	int octaves = 1;
-	float persistence = 0.5f;
-  float lacunarity = 2.0f;
-	int repeatx = 1024; // arbitrary
-	int repeaty = 1024; // arbitrary
-	int repeatz = 1024; // arbitrary
-	int base = 0;
+	int m;
+	a->ncells = 0;
+	for (m = 0; m < n; m++) {
+		float t = v[m] * freq;
+		const int c = (int)t;
+		a->lo[m] = (c + base) & 255;
+		a->hi[m] = (((c + 1) % repeat) + base) & 255;
+		if (hash) {
+			a->lo[m] = PERM[a->lo[m]];
+			a->hi[m] = PERM[a->hi[m]];
+		}
+		t -= (float)c;
+		a->t[m] = t;
+		a->f[m] = t*t*t * (t * (t * 6 - 15) + 10);
+		if (a->tq) {
+			// Rounded, but kept below 1 so that gradient differences fit
+			// in 16 bits
+			const int tq = (int)(t * FIXED_ONE + .5f), fq = (int)(a->f[m] * 32768 + .5f);
+			a->tq[m] = (short)(tq < FIXED_ONE - 1 ? tq : FIXED_ONE - 1);
+			a->fq[m] = (short)(fq < 32767 ? fq : 32767);
+			if (m == 0 || a->lo[m] != a->lo[m-1] || a->hi[m] != a->hi[m-1])
+				a->first[a->ncells++] = m;
+			a->cell[m] = a->ncells - 1;
+		}
+	}
+}
 
+// The number of octaves before the amplitude becomes negligible, with the
+// same octave schedule as the original per-sample loop
+static int
+octave_levels(const int octaves, const float persistence)
+{
+	float amp = 1.0f;
+	int l, levels = 0;
+	for (l = 0; l < octaves; l++) {
+		levels++;
+		amp *= persistence;
+		if (amp < .004) break; // No chance of influence beyond ~1/256
+	}
+	return levels;
+}
 
-  float *x, *y, *z;
-  PyArrayObject *_x, *_y, *_z;
-  PyObject *__x, *__y, *__z;
+// Build the tables for the grid x/y/z.  Returns -1 if out of memory.
+static int
+lattice_build(perlin_lattice *L, const float *x, const float *y, const float *z,
+	const int len_x, const int len_y, const int len_z, const perlin_params *p)
+{
+	float freq = 1.0f;
+	float amp = 1.0f;
+	int l;
+	const int levels = octave_levels(p->octaves, p->persistence);
+	char *mem;
+	const size_t per_entry = 2*(sizeof(int) + sizeof(float)) + (p->fixed ? 2*(sizeof(short) + sizeof(int)) : 0);
+	const size_t per_level = per_entry*((size_t)len_x + len_y + len_z);
+	mem = (char*)malloc(levels*(sizeof(float) + sizeof(int) + 3*sizeof(lattice_axis) + per_level));
+	if (!mem)
+		return -1;
+	L->mem = mem;
+	L->len_x = len_x;
+	L->len_y = len_y;
+	L->len_z = len_z;
+	L->levels = levels;
+	L->single = p->octaves == 1;
+	L->fixed = p->fixed;
+	L->x = (lattice_axis*)mem;
+	L->y = L->x + levels;
+	L->z = L->y + levels;
+	L->amp = (float*)(L->z + levels);
+	L->weight = (int*)(L->amp + levels);
+	mem = (char*)(L->weight + levels);
+	L->max = 0.0f;
+	amp = 1.0f;
+	for (l = 0; l < levels; l++) {
+		lattice_axis *axes[3] = { &L->x[l], &L->y[l], &L->z[l] };
+		const int lens[3] = { len_x, len_y, len_z };
+		int d;
+		for (d = 0; d < 3; d++) {
+			axes[d]->lo = (int*)mem; mem += lens[d]*sizeof(int);
+			axes[d]->hi = (int*)mem; mem += lens[d]*sizeof(int);
+			axes[d]->t = (float*)mem; mem += lens[d]*sizeof(float);
+			axes[d]->f = (float*)mem; mem += lens[d]*sizeof(float);
+			axes[d]->tq = axes[d]->fq = NULL;
+			axes[d]->cell = axes[d]->first = NULL;
+			if (p->fixed) {
+				axes[d]->cell = (int*)mem; mem += lens[d]*sizeof(int);
+				axes[d]->first = (int*)mem; mem += lens[d]*sizeof(int);
+				axes[d]->tq = (short*)mem; mem += lens[d]*sizeof(short);
+				axes[d]->fq = (short*)mem; mem += lens[d]*sizeof(short);
+			}
+		}
+		lattice_axis_fill(&L->x[l], x, len_x, freq, (const int)(p->repeatx*freq), p->base, 1);
+		lattice_axis_fill(&L->y[l], y, len_y, freq, (const int)(p->repeaty*freq), p->base, 0);
+		lattice_axis_fill(&L->z[l], z, len_z, freq, (const int)(p->repeatz*freq), p->base, 0);
+		L->amp[l] = amp;
+		L->max += amp;
+		freq *= p->lacunarity;
+		amp *= p->persistence;
+	}
+	for (l = 0; l < levels; l++) {
+		const int w = (int)(L->amp[l] / L->max * 32768 + .5f);
+		L->weight[l] = w < 32767 ? w : 32767;
+	}
+	return 0;
+}
 
-	static char *kwlist[] = {"x", "y", "z", "octaves", "persistence", "lacunarity",
-		"repeatx", "repeaty", "repeatz", "base", NULL};
+static void
+lattice_free(perlin_lattice *L)
+{
+	free(L->mem);
+	L->mem = NULL;
+}
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOO|iffiiii:noise3", kwlist,
-		&__x, &__y, &__z, &octaves, &persistence, &lacunarity, &repeatx, &repeaty, &repeatz, &base))
-		return NULL;
-  if (base < 0 || base > 255) {
-    PyErr_SetString(PyExc_ValueError, "Base must be between 0 and 255");
-    return NULL;
-  }
-  _x = (PyArrayObject*)PyArray_FROMANY(__x, NPY_FLOAT, 1, 1, NPY_ARRAY_C_CONTIGUOUS);
-  _y = (PyArrayObject*)PyArray_FROMANY(__y, NPY_FLOAT, 1, 1, NPY_ARRAY_C_CONTIGUOUS);
-  _z = (PyArrayObject*)PyArray_FROMANY(__z, NPY_FLOAT, 1, 1, NPY_ARRAY_C_CONTIGUOUS);
-  if (!_x || !_y || !_z)
-    return NULL;
-  x = (float*)PyArray_DATA(_x);
-  y = (float*)PyArray_DATA(_y);
-  z = (float*)PyArray_DATA(_z);
-  int len_x = PyArray_SIZE(_x);
-  int len_y = PyArray_SIZE(_y);
-  int len_z = PyArray_SIZE(_z);
-  int i,j,k,l;
-  float *ret = (float*)malloc(sizeof(float)*len_x*len_y*len_z);
-  if (x[len_x-1] >= repeatx || y[len_y-1] >= repeaty || z[len_z-1] >= repeatz) {
-		PyErr_SetString(PyExc_ValueError, "Cannot pass values greater than repeatx/y/z");
-    return NULL;
-  }
+// The blending half of noise3, given the hashes of the four (x,y) corners
+// and the z cells.
+static inline float
+lattice_corners(const int AA, const int AB, const int BA, const int BB,
+	const int k, const int kk, const float x, const float y, const float z,
+	const float fx, const float fy, const float fz)
+{
+	return lerp(fz, lerp(fy, lerp(fx, grad3(PERM[AA + k], x, y, z),
+									  grad3(PERM[BA + k], x - 1, y, z)),
+							 lerp(fx, grad3(PERM[AB + k], x, y - 1, z),
+									  grad3(PERM[BB + k], x - 1, y - 1, z))),
+					lerp(fy, lerp(fx, grad3(PERM[AA + kk], x, y, z - 1),
+									  grad3(PERM[BA + kk], x - 1, y, z - 1)),
+							 lerp(fx, grad3(PERM[AB + kk], x, y - 1, z - 1),
+									  grad3(PERM[BB + kk], x - 1, y - 1, z - 1))));
+}
 
-	if (octaves == 1) {
-		// Single octave, return simple noise
-    for (i=0; i<len_x; i++) {
-      for (j=0; j<len_y; j++) {
-        for (k=0; k<len_z; k++) {
-          ret[i*len_y*len_z+j*len_z+k] = noise3(x[i], y[j], z[k],
-                                                repeatx, repeaty, repeatz, base);
-        }
-      }
-    }
-	} else if (octaves > 1) {
-    for (i=0; i<len_x; i++) {
-      for (j=0; j<len_y; j++) {
-        for (k=0; k<len_z; k++) {
-          float freq = 1.0f;
-          float amp = 1.0f;
-          float max = 0.0f;
-          float total = 0.0f;
-          for (l = 0; l < octaves; l++) {
-            total += noise3(x[i] * freq, y[j] * freq, z[k] * freq,
-              (const int)(repeatx*freq), (const int)(repeaty*freq), (const int)(repeatz*freq), base) * amp;
-            max += amp;
-            freq *= lacunarity;
-            amp *= persistence;
-            if (amp < .004) break; // No chance of influence beyond ~1/256
-          }
-          ret[i*len_y*len_z+j*len_z+k] = (float) (total / max);
-        }
-      }
-    }
-	} else {
-		PyErr_SetString(PyExc_ValueError, "Expected octaves value > 0");
-		return NULL;
+// Sum octave l into the running total for one sample, in the same order of
+// operations as the original per-sample loop.
+static inline void
+accumulate(const perlin_lattice *L, const int l, const float v, float *total)
+{
+	if (L->single)
+		*total = v;
+	else if (l == 0)
+		*total = 0.0f + v * L->amp[l];
+	else
+		*total += v * L->amp[l];
+}
+
+// Compute samples start to end-1 of one row of the output, writing sample
+// start to out[0].  For LAYOUT_XYZ the row is along z at x index outer, for
+// LAYOUT_ZYX it is along x at z index outer.  The octaves are the outer loop
+// so that the hashing for the fixed coordinates is only done once per row.
+typedef void (*perlin_row_fn)(const perlin_lattice *L, const int layout,
+	const int outer, const int j, const int start, const int end, float *out);
+
+static void
+perlin_row_scalar(const perlin_lattice *L, const int layout, const int outer,
+	const int j, const int start, const int end, float *out)
+{
+	int l, m;
+	for (l = 0; l < L->levels; l++) {
+		const lattice_axis *X = &L->x[l], *Y = &L->y[l], *Z = &L->z[l];
+		const int j0 = Y->lo[j], j1 = Y->hi[j];
+		const float y = Y->t[j], fy = Y->f[j];
+		if (layout == LAYOUT_ZYX) {
+			const int k = outer;
+			for (m = start; m < end; m++) {
+				const int A = X->lo[m], B = X->hi[m];
+				accumulate(L, l, lattice_corners(PERM[A + j0], PERM[A + j1], PERM[B + j0], PERM[B + j1],
+					Z->lo[k], Z->hi[k], X->t[m], y, Z->t[k], X->f[m], fy, Z->f[k]), out + (m - start));
+			}
+		} else {
+			const int i = outer;
+			const int A = X->lo[i], B = X->hi[i];
+			const int AA = PERM[A + j0], AB = PERM[A + j1], BA = PERM[B + j0], BB = PERM[B + j1];
+			for (m = start; m < end; m++)
+				accumulate(L, l, lattice_corners(AA, AB, BA, BB, Z->lo[m], Z->hi[m],
+					X->t[i], y, Z->t[m], X->f[i], fy, Z->f[m]), out + (m - start));
+		}
 	}
-  npy_intp dims[3] = { len_x, len_y, len_z };
-  PyObject *retarray = PyArray_SimpleNewFromData(3, dims, NPY_FLOAT, ret);
-  PyArray_ENABLEFLAGS((PyArrayObject*)retarray, NPY_ARRAY_OWNDATA);
-  Py_DECREF(_x);
-  Py_DECREF(_y);
-  Py_DECREF(_z);
-  return retarray;
+	if (!L->single)
+		for (m = 0; m < end - start; m++)
+			out[m] = (float) (out[m] / L->max);
 }
 
-static PyMethodDef perlin_functions[] = {
-	{"make_perlin", (PyCFunction) make_perlin, METH_VARARGS | METH_KEYWORDS,
-    "Generate a perlin noise stimulus\n\
-\n\
-    Parameters\n\
-    ----------\n\
-    x,y,z : 1D ndarray of float32, length > 0\n\
-        Grid of positions on which to compute the noise\n\
-    octaves : int > 0, default: 1\n\
-        Number of spatial scales to include\n\
-    persistence : float > 0, default: 0.5\n\
-        Relative strength of neighbouring octaves\n\
-    repeatx,repeaty,repeatz : int > 0, default: 1024\n\
-        Maximum x, y, or z value before the stimulus repeats\n\
-    base : int ∈ [0,255], default: 0\n\
-        Start position of the permutation, essentially the random seed\n\
-\n\
-    Returns\n\
-    -------\n\
-    3D int ndarray, values ∈ [0,255]\n\
-        Pink noise movie\n\
-"},
+// PERM widened to 32 bits for the gather instructions, GRAD3 stored by
+// column for the shuffles, and GRAD3 as integers for the fixed-point
+// kernels.  All are filled in by init_tables.
+static int PERM32[512];
+static float GRAD3T[3][16];
+static int GRAD3I[16][3];
+static signed char GRAD3B[3][16];
+
+static void
+init_tables(void)
+{
+	int i, d;
+	for (i = 0; i < 512; i++)
+		PERM32[i] = PERM[i];
+	for (i = 0; i < 16; i++)
+		for (d = 0; d < 3; d++) {
+			GRAD3T[d][i] = GRAD3[i][d];
+			GRAD3I[i][d] = (int)GRAD3[i][d];
+			GRAD3B[d][i] = (signed char)GRAD3[i][d];
+		}
+}
+
+// The row kernels of the fixed-point lattices, see FIXED_SHIFT.  They take
+// the same arguments as perlin_row but write Q2.13 values, and all of them
+// give identical output.  The hashes of the eight corners of a cell only
+// depend on the cell, and a row usually spans few cells along its axis, so
+// the kernels first pack the gradient indices of each cell in the row into
+// one word of hashes, with space for one word per cell along the axis.
+typedef void (*perlin_row_fixed_fn)(const perlin_lattice *L, const int layout,
+	const int outer, const int j, const int start, const int end, short *out,
+	unsigned int *hashes);
+
+// t*v rounded, for t in Q0.15, as the SIMD rounding multiplies do
+static inline int
+mulq15(const int t, const int v)
+{
+	return (t * v + 0x4000) >> 15;
+}
+
+static inline int
+lerp_fixed(const int t, const int a, const int b)
+{
+	return a + mulq15(t, b - a);
+}
+
+static inline int
+grad3_fixed(const int h, const int x, const int y, const int z)
+{
+	return x * GRAD3I[h][0] + y * GRAD3I[h][1] + z * GRAD3I[h][2];
+}
+
+// The GRAD3 indices of the eight corners, four bits each, in the order
+// they are blended by lattice_corners
+static inline unsigned int
+corner_hashes(const int AA, const int AB, const int BA, const int BB, const int k, const int kk)
+{
+	return (PERM[AA + k] & 15u) | (PERM[BA + k] & 15u) << 4
+		| (PERM[AB + k] & 15u) << 8 | (PERM[BB + k] & 15u) << 12
+		| (PERM[AA + kk] & 15u) << 16 | (PERM[BA + kk] & 15u) << 20
+		| (PERM[AB + kk] & 15u) << 24 | (PERM[BB + kk] & 15u) << 28;
+}
+
+// Fill hashes for the cells of positions start to end-1 along the row's
+// axis.  For LAYOUT_ZYX that is x, otherwise z.
+static void
+row_hashes(const perlin_lattice *L, const int l, const int layout, const int outer,
+	const int j, const int start, const int end, unsigned int *hashes)
+{
+	const lattice_axis *X = &L->x[l], *Y = &L->y[l], *Z = &L->z[l];
+	const lattice_axis *R = layout == LAYOUT_ZYX ? X : Z;
+	const int j0 = Y->lo[j], j1 = Y->hi[j];
+	int c;
+	for (c = R->cell[start]; c <= R->cell[end-1]; c++) {
+		const int m = R->first[c];
+		if (layout == LAYOUT_ZYX) {
+			const int A = X->lo[m], B = X->hi[m];
+			hashes[c] = corner_hashes(PERM[A + j0], PERM[A + j1], PERM[B + j0], PERM[B + j1],
+				Z->lo[outer], Z->hi[outer]);
+		} else {
+			const int A = X->lo[outer], B = X->hi[outer];
+			hashes[c] = corner_hashes(PERM[A + j0], PERM[A + j1], PERM[B + j0], PERM[B + j1],
+				Z->lo[m], Z->hi[m]);
+		}
+	}
+}
+
+static inline int
+lattice_corners_fixed(const unsigned int h, const int x, const int y, const int z,
+	const int fx, const int fy, const int fz)
+{
+	const int x1 = x - FIXED_ONE, y1 = y - FIXED_ONE, z1 = z - FIXED_ONE;
+	return lerp_fixed(fz, lerp_fixed(fy, lerp_fixed(fx, grad3_fixed(h & 15, x, y, z),
+										grad3_fixed(h >> 4 & 15, x1, y, z)),
+							lerp_fixed(fx, grad3_fixed(h >> 8 & 15, x, y1, z),
+										grad3_fixed(h >> 12 & 15, x1, y1, z))),
+					lerp_fixed(fy, lerp_fixed(fx, grad3_fixed(h >> 16 & 15, x, y, z1),
+										grad3_fixed(h >> 20 & 15, x1, y, z1)),
+							lerp_fixed(fx, grad3_fixed(h >> 24 & 15, x, y1, z1),
+										grad3_fixed(h >> 28, x1, y1, z1))));
+}
+
+// Sum octave l into the running total, weighted by amp/max
+static inline void
+accumulate_fixed(const perlin_lattice *L, const int l, const int v, short *total)
+{
+	if (L->single)
+		*total = (short)v;
+	else if (l == 0)
+		*total = (short)mulq15(L->weight[l], v);
+	else
+		*total = (short)(*total + mulq15(L->weight[l], v));
+}
+
+static void
+perlin_row_fixed_scalar(const perlin_lattice *L, const int layout, const int outer,
+	const int j, const int start, const int end, short *out, unsigned int *hashes)
+{
+	int l, m;
+	if (start >= end)
+		return;
+	for (l = 0; l < L->levels; l++) {
+		const lattice_axis *X = &L->x[l], *Y = &L->y[l], *Z = &L->z[l];
+		const int y = Y->tq[j], fy = Y->fq[j];
+		row_hashes(L, l, layout, outer, j, start, end, hashes);
+		if (layout == LAYOUT_ZYX) {
+			const int k = outer;
+			for (m = start; m < end; m++)
+				accumulate_fixed(L, l, lattice_corners_fixed(hashes[X->cell[m]],
+					X->tq[m], y, Z->tq[k], X->fq[m], fy, Z->fq[k]), out + (m - start));
+		} else {
+			const int i = outer;
+			for (m = start; m < end; m++)
+				accumulate_fixed(L, l, lattice_corners_fixed(hashes[Z->cell[m]],
+					X->tq[i], y, Z->tq[m], X->fq[i], fy, Z->fq[m]), out + (m - start));
+		}
+	}
+}
+
+// Vectorised kernels for x86-64.  These perform exactly the same sequence of
+// float operations as the scalar kernel, one sample per lane, so their
+// output is bit-for-bit identical to it.  This relies on the compiler not
+// fusing multiplies and adds, hence -ffp-contract=off in setup.py.  The
+// 32-bit x86 builds use the x87 unit for the scalar path, so they always
+// use the scalar kernel.
+#if defined(__x86_64__) || defined(_M_X64)
+#define PERLIN_X86_SIMD
+#include <immintrin.h>
+#if defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
+
+static inline TARGET_AVX2 __m256
+lerp8_avx2(const __m256 t, const __m256 a, const __m256 b)
+{
+	return _mm256_add_ps(a, _mm256_mul_ps(t, _mm256_sub_ps(b, a)));
+}
+
+// GRAD3 lookup as a pair of 8-entry shuffles, selected by bit 3 of the hash
+static inline TARGET_AVX2 __m256
+gradcol8_avx2(const float *col, const __m256i h, const __m256 hi)
+{
+	return _mm256_blendv_ps(_mm256_permutevar8x32_ps(_mm256_loadu_ps(col), h),
+		_mm256_permutevar8x32_ps(_mm256_loadu_ps(col + 8), h), hi);
+}
+
+static inline TARGET_AVX2 __m256
+grad8_avx2(const __m256i idx, const __m256 x, const __m256 y, const __m256 z)
+{
+	const __m256i h = _mm256_i32gather_epi32(PERM32, idx, 4);
+	const __m256 hi = _mm256_castsi256_ps(_mm256_slli_epi32(h, 28));
+	return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, gradcol8_avx2(GRAD3T[0], h, hi)),
+			_mm256_mul_ps(y, gradcol8_avx2(GRAD3T[1], h, hi))),
+		_mm256_mul_ps(z, gradcol8_avx2(GRAD3T[2], h, hi)));
+}
+
+static inline TARGET_AVX2 __m256
+corners8_avx2(const __m256i AA, const __m256i AB, const __m256i BA, const __m256i BB,
+	const __m256i k, const __m256i kk, const __m256 x, const __m256 y, const __m256 z,
+	const __m256 fx, const __m256 fy, const __m256 fz)
+{
+	const __m256 one = _mm256_set1_ps(1);
+	const __m256 x1 = _mm256_sub_ps(x, one);
+	const __m256 y1 = _mm256_sub_ps(y, one);
+	const __m256 z1 = _mm256_sub_ps(z, one);
+	return lerp8_avx2(fz,
+		lerp8_avx2(fy, lerp8_avx2(fx, grad8_avx2(_mm256_add_epi32(AA, k), x, y, z),
+				grad8_avx2(_mm256_add_epi32(BA, k), x1, y, z)),
+			lerp8_avx2(fx, grad8_avx2(_mm256_add_epi32(AB, k), x, y1, z),
+				grad8_avx2(_mm256_add_epi32(BB, k), x1, y1, z))),
+		lerp8_avx2(fy, lerp8_avx2(fx, grad8_avx2(_mm256_add_epi32(AA, kk), x, y, z1),
+				grad8_avx2(_mm256_add_epi32(BA, kk), x1, y, z1)),
+			lerp8_avx2(fx, grad8_avx2(_mm256_add_epi32(AB, kk), x, y1, z1),
+				grad8_avx2(_mm256_add_epi32(BB, kk), x1, y1, z1))));
+}
+
+static inline TARGET_AVX2 void
+accumulate8_avx2(const perlin_lattice *L, const int l, const __m256 v, float *total)
+{
+	if (L->single)
+		_mm256_storeu_ps(total, v);
+	else if (l == 0)
+		_mm256_storeu_ps(total, _mm256_add_ps(_mm256_setzero_ps(), _mm256_mul_ps(v, _mm256_set1_ps(L->amp[l]))));
+	else
+		_mm256_storeu_ps(total, _mm256_add_ps(_mm256_loadu_ps(total), _mm256_mul_ps(v, _mm256_set1_ps(L->amp[l]))));
+}
+
+static TARGET_AVX2 void
+perlin_row_avx2(const perlin_lattice *L, const int layout, const int outer,
+	const int j, const int start, const int end, float *out)
+{
+	const int vend = start + (end - start) / 8 * 8;
+	int l, m;
+	for (l = 0; l < L->levels; l++) {
+		const lattice_axis *X = &L->x[l], *Y = &L->y[l], *Z = &L->z[l];
+		const __m256i j0 = _mm256_set1_epi32(Y->lo[j]), j1 = _mm256_set1_epi32(Y->hi[j]);
+		const __m256 y = _mm256_set1_ps(Y->t[j]), fy = _mm256_set1_ps(Y->f[j]);
+		if (layout == LAYOUT_ZYX) {
+			const int k = outer;
+			const __m256i k0 = _mm256_set1_epi32(Z->lo[k]), k1 = _mm256_set1_epi32(Z->hi[k]);
+			const __m256 z = _mm256_set1_ps(Z->t[k]), fz = _mm256_set1_ps(Z->f[k]);
+			for (m = start; m < vend; m += 8) {
+				const __m256i A = _mm256_loadu_si256((const __m256i*)(X->lo + m));
+				const __m256i B = _mm256_loadu_si256((const __m256i*)(X->hi + m));
+				accumulate8_avx2(L, l, corners8_avx2(
+					_mm256_i32gather_epi32(PERM32, _mm256_add_epi32(A, j0), 4),
+					_mm256_i32gather_epi32(PERM32, _mm256_add_epi32(A, j1), 4),
+					_mm256_i32gather_epi32(PERM32, _mm256_add_epi32(B, j0), 4),
+					_mm256_i32gather_epi32(PERM32, _mm256_add_epi32(B, j1), 4),
+					k0, k1, _mm256_loadu_ps(X->t + m), y, z, _mm256_loadu_ps(X->f + m), fy, fz), out + (m - start));
+			}
+		} else {
+			const int i = outer;
+			const int A = X->lo[i], B = X->hi[i];
+			const __m256i AA = _mm256_set1_epi32(PERM[A + Y->lo[j]]), AB = _mm256_set1_epi32(PERM[A + Y->hi[j]]);
+			const __m256i BA = _mm256_set1_epi32(PERM[B + Y->lo[j]]), BB = _mm256_set1_epi32(PERM[B + Y->hi[j]]);
+			const __m256 x = _mm256_set1_ps(X->t[i]), fx = _mm256_set1_ps(X->f[i]);
+			for (m = start; m < vend; m += 8)
+				accumulate8_avx2(L, l, corners8_avx2(AA, AB, BA, BB,
+					_mm256_loadu_si256((const __m256i*)(Z->lo + m)), _mm256_loadu_si256((const __m256i*)(Z->hi + m)),
+					x, y, _mm256_loadu_ps(Z->t + m), fx, fy, _mm256_loadu_ps(Z->f + m)), out + (m - start));
+		}
+	}
+	if (!L->single)
+		for (m = 0; m < vend - start; m += 8)
+			_mm256_storeu_ps(out + m, _mm256_div_ps(_mm256_loadu_ps(out + m), _mm256_set1_ps(L->max)));
+	perlin_row_scalar(L, layout, outer, j, vend, end, out + (vend - start));
+}
+
+// The fixed-point kernel, with 16 lanes of 16 bits.  The word of corner
+// hashes of each sample is gathered and split into two 16-bit halves, and
+// each gradient component is then a sign change selected by a byte shuffle
+// of the hash.
+static inline TARGET_AVX2 __m256i
+lerp_fixed_avx2(const __m256i t, const __m256i a, const __m256i b)
+{
+	return _mm256_add_epi16(a, _mm256_mulhrs_epi16(t, _mm256_sub_epi16(b, a)));
+}
+
+// Pack two vectors of 8 ints in [0,65535] into 16-bit lanes, in order
+static inline TARGET_AVX2 __m256i
+pack_fixed_avx2(const __m256i lo, const __m256i hi)
+{
+	return _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xd8);
+}
+
+// One column of GRAD3, as the sign of each lane, which is all that
+// _mm256_sign_epi16 looks at
+static inline TARGET_AVX2 __m256i
+gradcol_fixed_avx2(const signed char *col, const __m256i idx)
+{
+	return _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)col)), idx);
+}
+
+// The gradient of corner c, whose hash is in bits 4c to 4c+3 of half, the
+// low or high half of the words of corner hashes.  The shuffle indices
+// put the hash in the high byte of each lane, and zero the low byte.
+static inline TARGET_AVX2 __m256i
+grad_fixed_avx2(const __m256i half, const int c, const __m256i x, const __m256i y, const __m256i z)
+{
+	const __m256i h = c < 3 ? _mm256_slli_epi16(half, 8 - 4*c) : _mm256_srli_epi16(half, 4);
+	const __m256i idx = _mm256_or_si256(_mm256_and_si256(h, _mm256_set1_epi16(0x0f00)), _mm256_set1_epi16(0x80));
+	return _mm256_add_epi16(_mm256_add_epi16(_mm256_sign_epi16(x, gradcol_fixed_avx2(GRAD3B[0], idx)),
+			_mm256_sign_epi16(y, gradcol_fixed_avx2(GRAD3B[1], idx))),
+		_mm256_sign_epi16(z, gradcol_fixed_avx2(GRAD3B[2], idx)));
+}
+
+// row_hashes for 8 cells at a time.  Rows of fine octaves may have almost
+// as many cells as samples.
+static TARGET_AVX2 void
+row_hashes_avx2(const perlin_lattice *L, const int l, const int layout, const int outer,
+	const int j, const int start, const int end, unsigned int *hashes)
+{
+	const lattice_axis *X = &L->x[l], *Y = &L->y[l], *Z = &L->z[l];
+	const lattice_axis *R = layout == LAYOUT_ZYX ? X : Z;
+	const int c0 = R->cell[start], c1 = R->cell[end-1] + 1;
+	const int vend = c0 + (c1 - c0) / 8 * 8;
+	const __m256i j0 = _mm256_set1_epi32(Y->lo[j]), j1 = _mm256_set1_epi32(Y->hi[j]);
+	const __m256i mask = _mm256_set1_epi32(15);
+	int c, n;
+	for (c = c0; c < vend; c += 8) {
+		const __m256i m = _mm256_loadu_si256((const __m256i*)(R->first + c));
+		__m256i A, B, k, kk, h = _mm256_setzero_si256();
+		if (layout == LAYOUT_ZYX) {
+			A = _mm256_i32gather_epi32(X->lo, m, 4);
+			B = _mm256_i32gather_epi32(X->hi, m, 4);
+			k = _mm256_set1_epi32(Z->lo[outer]);
+			kk = _mm256_set1_epi32(Z->hi[outer]);
+		} else {
+			A = _mm256_set1_epi32(X->lo[outer]);
+			B = _mm256_set1_epi32(X->hi[outer]);
+			k = _mm256_i32gather_epi32(Z->lo, m, 4);
+			kk = _mm256_i32gather_epi32(Z->hi, m, 4);
+		}
+		{
+			const __m256i corners[4] = {
+				_mm256_i32gather_epi32(PERM32, _mm256_add_epi32(A, j0), 4),
+				_mm256_i32gather_epi32(PERM32, _mm256_add_epi32(B, j0), 4),
+				_mm256_i32gather_epi32(PERM32, _mm256_add_epi32(A, j1), 4),
+				_mm256_i32gather_epi32(PERM32, _mm256_add_epi32(B, j1), 4) };
+			// Same order as corner_hashes
+			for (n = 0; n < 8; n++) {
+				const __m256i g = _mm256_i32gather_epi32(PERM32, _mm256_add_epi32(corners[n & 3], n < 4 ? k : kk), 4);
+				h = _mm256_or_si256(h, _mm256_sll_epi32(_mm256_and_si256(g, mask), _mm_cvtsi32_si128(4*n)));
+			}
+		}
+		_mm256_storeu_si256((__m256i*)(hashes + c), h);
+	}
+	if (vend < c1)
+		row_hashes(L, l, layout, outer, j, R->first[vend] > start ? R->first[vend] : start, end, hashes);
+}
+
+// lattice_corners_fixed for 16 samples, given the indices of their cells
+// into hashes as two vectors of 8
+static inline TARGET_AVX2 __m256i
+corners_fixed_avx2(const unsigned int *hashes, const __m256i c0, const __m256i c1,
+	const __m256i x, const __m256i y, const __m256i z,
+	const __m256i fx, const __m256i fy, const __m256i fz)
+{
+	const __m256i one = _mm256_set1_epi16(FIXED_ONE), low = _mm256_set1_epi32(0xffff);
+	const __m256i x1 = _mm256_sub_epi16(x, one);
+	const __m256i y1 = _mm256_sub_epi16(y, one);
+	const __m256i z1 = _mm256_sub_epi16(z, one);
+	const __m256i w0 = _mm256_i32gather_epi32((const int*)hashes, c0, 4);
+	const __m256i w1 = _mm256_i32gather_epi32((const int*)hashes, c1, 4);
+	const __m256i k = pack_fixed_avx2(_mm256_and_si256(w0, low), _mm256_and_si256(w1, low));
+	const __m256i kk = pack_fixed_avx2(_mm256_srli_epi32(w0, 16), _mm256_srli_epi32(w1, 16));
+	return lerp_fixed_avx2(fz,
+		lerp_fixed_avx2(fy, lerp_fixed_avx2(fx, grad_fixed_avx2(k, 0, x, y, z), grad_fixed_avx2(k, 1, x1, y, z)),
+			lerp_fixed_avx2(fx, grad_fixed_avx2(k, 2, x, y1, z), grad_fixed_avx2(k, 3, x1, y1, z))),
+		lerp_fixed_avx2(fy, lerp_fixed_avx2(fx, grad_fixed_avx2(kk, 0, x, y, z1), grad_fixed_avx2(kk, 1, x1, y, z1)),
+			lerp_fixed_avx2(fx, grad_fixed_avx2(kk, 2, x, y1, z1), grad_fixed_avx2(kk, 3, x1, y1, z1))));
+}
+
+static inline TARGET_AVX2 void
+accumulate_fixed_avx2(const perlin_lattice *L, const int l, const __m256i v, short *total)
+{
+	if (L->single)
+		_mm256_storeu_si256((__m256i*)total, v);
+	else if (l == 0)
+		_mm256_storeu_si256((__m256i*)total, _mm256_mulhrs_epi16(_mm256_set1_epi16((short)L->weight[l]), v));
+	else
+		_mm256_storeu_si256((__m256i*)total, _mm256_add_epi16(_mm256_loadu_si256((const __m256i*)total),
+			_mm256_mulhrs_epi16(_mm256_set1_epi16((short)L->weight[l]), v)));
+}
+
+static TARGET_AVX2 void
+perlin_row_fixed_avx2(const perlin_lattice *L, const int layout, const int outer,
+	const int j, const int start, const int end, short *out, unsigned int *hashes)
+{
+	const int vend = start + (end - start) / 16 * 16;
+	int l, m;
+	for (l = 0; l < L->levels && vend > start; l++) {
+		const lattice_axis *X = &L->x[l], *Y = &L->y[l], *Z = &L->z[l];
+		const __m256i y = _mm256_set1_epi16(Y->tq[j]), fy = _mm256_set1_epi16(Y->fq[j]);
+		row_hashes_avx2(L, l, layout, outer, j, start, vend, hashes);
+		if (layout == LAYOUT_ZYX) {
+			const int k = outer;
+			const __m256i z = _mm256_set1_epi16(Z->tq[k]), fz = _mm256_set1_epi16(Z->fq[k]);
+			for (m = start; m < vend; m += 16)
+				accumulate_fixed_avx2(L, l, corners_fixed_avx2(hashes,
+					_mm256_loadu_si256((const __m256i*)(X->cell + m)), _mm256_loadu_si256((const __m256i*)(X->cell + m + 8)),
+					_mm256_loadu_si256((const __m256i*)(X->tq + m)), y, z,
+					_mm256_loadu_si256((const __m256i*)(X->fq + m)), fy, fz), out + (m - start));
+		} else {
+			const int i = outer;
+			const __m256i x = _mm256_set1_epi16(X->tq[i]), fx = _mm256_set1_epi16(X->fq[i]);
+			for (m = start; m < vend; m += 16)
+				accumulate_fixed_avx2(L, l, corners_fixed_avx2(hashes,
+					_mm256_loadu_si256((const __m256i*)(Z->cell + m)), _mm256_loadu_si256((const __m256i*)(Z->cell + m + 8)),
+					x, y, _mm256_loadu_si256((const __m256i*)(Z->tq + m)),
+					fx, fy, _mm256_loadu_si256((const __m256i*)(Z->fq + m))), out + (m - start));
+		}
+	}
+	perlin_row_fixed_scalar(L, layout, outer, j, vend, end, out + (vend - start), hashes);
+}
+
+static inline TARGET_AVX512 __m512
+lerp16_avx512(const __m512 t, const __m512 a, const __m512 b)
+{
+	return _mm512_add_ps(a, _mm512_mul_ps(t, _mm512_sub_ps(b, a)));
+}
+
+// With 16 lanes, each GRAD3 column is a single shuffle
+static inline TARGET_AVX512 __m512
+grad16_avx512(const __m512i idx, const __m512 x, const __m512 y, const __m512 z)
+{
+	const __m512i h = _mm512_i32gather_epi32(idx, PERM32, 4);
+	return _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(x, _mm512_permutexvar_ps(h, _mm512_loadu_ps(GRAD3T[0]))),
+			_mm512_mul_ps(y, _mm512_permutexvar_ps(h, _mm512_loadu_ps(GRAD3T[1])))),
+		_mm512_mul_ps(z, _mm512_permutexvar_ps(h, _mm512_loadu_ps(GRAD3T[2]))));
+}
+
+static inline TARGET_AVX512 __m512
+corners16_avx512(const __m512i AA, const __m512i AB, const __m512i BA, const __m512i BB,
+	const __m512i k, const __m512i kk, const __m512 x, const __m512 y, const __m512 z,
+	const __m512 fx, const __m512 fy, const __m512 fz)
+{
+	const __m512 one = _mm512_set1_ps(1);
+	const __m512 x1 = _mm512_sub_ps(x, one);
+	const __m512 y1 = _mm512_sub_ps(y, one);
+	const __m512 z1 = _mm512_sub_ps(z, one);
+	return lerp16_avx512(fz,
+		lerp16_avx512(fy, lerp16_avx512(fx, grad16_avx512(_mm512_add_epi32(AA, k), x, y, z),
+				grad16_avx512(_mm512_add_epi32(BA, k), x1, y, z)),
+			lerp16_avx512(fx, grad16_avx512(_mm512_add_epi32(AB, k), x, y1, z),
+				grad16_avx512(_mm512_add_epi32(BB, k), x1, y1, z))),
+		lerp16_avx512(fy, lerp16_avx512(fx, grad16_avx512(_mm512_add_epi32(AA, kk), x, y, z1),
+				grad16_avx512(_mm512_add_epi32(BA, kk), x1, y, z1)),
+			lerp16_avx512(fx, grad16_avx512(_mm512_add_epi32(AB, kk), x, y1, z1),
+				grad16_avx512(_mm512_add_epi32(BB, kk), x1, y1, z1))));
+}
+
+static inline TARGET_AVX512 void
+accumulate16_avx512(const perlin_lattice *L, const int l, const __m512 v, float *total)
+{
+	if (L->single)
+		_mm512_storeu_ps(total, v);
+	else if (l == 0)
+		_mm512_storeu_ps(total, _mm512_add_ps(_mm512_setzero_ps(), _mm512_mul_ps(v, _mm512_set1_ps(L->amp[l]))));
+	else
+		_mm512_storeu_ps(total, _mm512_add_ps(_mm512_loadu_ps(total), _mm512_mul_ps(v, _mm512_set1_ps(L->amp[l]))));
+}
+
+static TARGET_AVX512 void
+perlin_row_avx512(const perlin_lattice *L, const int layout, const int outer,
+	const int j, const int start, const int end, float *out)
+{
+	const int vend = start + (end - start) / 16 * 16;
+	int l, m;
+	for (l = 0; l < L->levels; l++) {
+		const lattice_axis *X = &L->x[l], *Y = &L->y[l], *Z = &L->z[l];
+		const __m512i j0 = _mm512_set1_epi32(Y->lo[j]), j1 = _mm512_set1_epi32(Y->hi[j]);
+		const __m512 y = _mm512_set1_ps(Y->t[j]), fy = _mm512_set1_ps(Y->f[j]);
+		if (layout == LAYOUT_ZYX) {
+			const int k = outer;
+			const __m512i k0 = _mm512_set1_epi32(Z->lo[k]), k1 = _mm512_set1_epi32(Z->hi[k]);
+			const __m512 z = _mm512_set1_ps(Z->t[k]), fz = _mm512_set1_ps(Z->f[k]);
+			for (m = start; m < vend; m += 16) {
+				const __m512i A = _mm512_loadu_si512(X->lo + m);
+				const __m512i B = _mm512_loadu_si512(X->hi + m);
+				accumulate16_avx512(L, l, corners16_avx512(
+					_mm512_i32gather_epi32(_mm512_add_epi32(A, j0), PERM32, 4),
+					_mm512_i32gather_epi32(_mm512_add_epi32(A, j1), PERM32, 4),
+					_mm512_i32gather_epi32(_mm512_add_epi32(B, j0), PERM32, 4),
+					_mm512_i32gather_epi32(_mm512_add_epi32(B, j1), PERM32, 4),
+					k0, k1, _mm512_loadu_ps(X->t + m), y, z, _mm512_loadu_ps(X->f + m), fy, fz), out + (m - start));
+			}
+		} else {
+			const int i = outer;
+			const int A = X->lo[i], B = X->hi[i];
+			const __m512i AA = _mm512_set1_epi32(PERM[A + Y->lo[j]]), AB = _mm512_set1_epi32(PERM[A + Y->hi[j]]);
+			const __m512i BA = _mm512_set1_epi32(PERM[B + Y->lo[j]]), BB = _mm512_set1_epi32(PERM[B + Y->hi[j]]);
+			const __m512 x = _mm512_set1_ps(X->t[i]), fx = _mm512_set1_ps(X->f[i]);
+			for (m = start; m < vend; m += 16)
+				accumulate16_avx512(L, l, corners16_avx512(AA, AB, BA, BB,
+					_mm512_loadu_si512(Z->lo + m), _mm512_loadu_si512(Z->hi + m),
+					x, y, _mm512_loadu_ps(Z->t + m), fx, fy, _mm512_loadu_ps(Z->f + m)), out + (m - start));
+		}
+	}
+	if (!L->single)
+		for (m = 0; m < vend - start; m += 16)
+			_mm512_storeu_ps(out + m, _mm512_div_ps(_mm512_loadu_ps(out + m), _mm512_set1_ps(L->max)));
+	perlin_row_avx2(L, layout, outer, j, vend, end, out + (vend - start));
+}
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+static int
+cpu_supports(const int avx512)
+{
+	int info[4];
+	unsigned long long xcr0;
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return 0;
+	__cpuid(info, 1);
+	if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28))) // OSXSAVE and AVX
+		return 0;
+	xcr0 = _xgetbv(0);
+	__cpuidex(info, 7, 0);
+	if (avx512)
+		return (xcr0 & 0xe6) == 0xe6 && (info[1] & (1 << 16));
+	return (xcr0 & 0x6) == 0x6 && (info[1] & (1 << 5));
+}
+#else
+static int
+cpu_supports(const int avx512)
+{
+	__builtin_cpu_init();
+	if (avx512)
+		return __builtin_cpu_supports("avx512f");
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+#endif // x86-64
+
+// The row kernels used by make_perlin, chosen by select_kernel.  There is
+// no AVX-512 fixed-point kernel, so that uses the AVX2 one.
+static perlin_row_fn perlin_row = perlin_row_scalar;
+static perlin_row_fixed_fn perlin_row_fixed = perlin_row_fixed_scalar;
+static const char *perlin_simd = "scalar";
+
+static void
+select_kernel(void)
+{
+	perlin_row = perlin_row_scalar;
+	perlin_row_fixed = perlin_row_fixed_scalar;
+	perlin_simd = "scalar";
+#ifdef PERLIN_X86_SIMD
+	if (cpu_supports(1)) {
+		perlin_row = perlin_row_avx512;
+		perlin_simd = "avx512";
+	} else if (cpu_supports(0)) {
+		perlin_row = perlin_row_avx2;
+		perlin_simd = "avx2";
+	}
+	if (cpu_supports(0))
+		perlin_row_fixed = perlin_row_fixed_avx2;
+#endif
+}
+
+// Use the named kernel instead, or the best one for "auto".  Returns -1 if
+// it is unknown or not supported by this CPU.
+static int
+set_kernel(const char *name)
+{
+	if (strcmp(name, "auto") == 0)
+		select_kernel();
+	else if (strcmp(name, "scalar") == 0) {
+		perlin_row = perlin_row_scalar;
+		perlin_row_fixed = perlin_row_fixed_scalar;
+		perlin_simd = "scalar";
+	}
+#ifdef PERLIN_X86_SIMD
+	else if (strcmp(name, "avx2") == 0 && cpu_supports(0)) {
+		perlin_row = perlin_row_avx2;
+		perlin_row_fixed = perlin_row_fixed_avx2;
+		perlin_simd = "avx2";
+	} else if (strcmp(name, "avx512") == 0 && cpu_supports(1) && cpu_supports(0)) {
+		perlin_row = perlin_row_avx512;
+		perlin_row_fixed = perlin_row_fixed_avx2;
+		perlin_simd = "avx512";
+	}
+#endif
+	else
+		return -1;
+	return 0;
+}
+
+// Filters which can be applied in C, matching filter_frames in util.py.
+// "reverse" only reorders frames, so it is accepted and ignored.  All but
+// "blur" are per-pixel, and blur is only supported by postprocess, which
+// can work a whole frame at a time.
+enum { FILT_THRESHOLD, FILT_SOFTTHRESH, FILT_COMB, FILT_INVERT, FILT_WOOD, FILT_CENTER, FILT_REVERSE, FILT_BLUR };
+
+static const struct {
+	const char *name;
+	int op;
+	int nargs;
+} FILTER_NAMES[] = {
+	{"threshold", FILT_THRESHOLD, 1},
+	{"softthresh", FILT_SOFTTHRESH, 1},
+	{"comb", FILT_COMB, 1},
+	{"invert", FILT_INVERT, 0},
+	{"wood", FILT_WOOD, 1},
+	{"center", FILT_CENTER, 0},
+	{"reverse", FILT_REVERSE, 0},
+	{"blur", FILT_BLUR, 1},
 	{NULL}
 };
 
-PyDoc_STRVAR(module_doc, "Efficiently generate Perlin noise, based on the 'noise' package by Casey Duncan");
+#define MAX_FILTERS 16
 
-static struct PyModuleDef moduledef = {
-	PyModuleDef_HEAD_INIT,
-	"_perlin",
-	module_doc,
-	-1,                 /* m_size */
-	perlin_functions,   /* m_methods */
-	NULL,               /* m_reload (unused) */
-	NULL,               /* m_traverse */
-	NULL,               /* m_clear */
-	NULL                /* m_free */
-};
+typedef struct {
+	int op;
+	float arg;
+} filter_op;
 
-PyObject *
-PyInit__perlin(void)
+// What is done to each noise value on its way to the output buffer:
+// optionally v -> (v - min) * scale, then the filters in order, then for
+// uint8 output v -> v * 255 truncated to [0,255] like discretize.  int16
+// output is the noise itself in Q2.13, i.e. v * FIXED_ONE rounded.
+typedef struct {
+	int type;       // NPY_FLOAT, NPY_UINT8 or NPY_INT16
+	int normalise;
+	float min, scale;
+	int nfilters;
+	filter_op filters[MAX_FILTERS];
+	int nblur;      // How many of the filters are blurs
+	int blur_radius; // The largest radius of their kernels
+} perlin_output;
+
+// Floor division and remainder as numpy computes them for float32, so that
+// comb and wood agree exactly with filter_frames.
+static inline float
+floordivf(const float a, const float b)
 {
-  import_array();
-  return PyModule_Create(&moduledef);
+	const float mod = fmodf(a, b);
+	float div = (a - mod) / b;
+	float floordiv;
+	if (mod && ((b < 0) != (mod < 0)))
+		div -= 1.0f;
+	if (div) {
+		floordiv = floorf(div);
+		if (div - floordiv > 0.5f)
+			floordiv += 1.0f;
+	} else
+		floordiv = copysignf(0.0f, a / b);
+	return floordiv;
+}
+
+static inline float
+remainderf_py(const float a, const float b)
+{
+	float mod = fmodf(a, b);
+	if (mod) {
+		if ((b < 0) != (mod < 0))
+			mod += b;
+	} else
+		mod = copysignf(0.0f, b);
+	return mod;
+}
+
+static inline float
+apply_filter(const filter_op *f, const float v)
+{
+	switch (f->op) {
+	case FILT_THRESHOLD:
+		return v > f->arg ? 1.0f : 0.0f;
+	case FILT_SOFTTHRESH:
+		return 1.0f/(1.0f + expf(-f->arg*(v - 0.5f)));
+	case FILT_COMB:
+		return fabsf(fmodf(floordivf(v, f->arg), 2.0f)) == 1.0f ? 1.0f : 0.0f;
+	case FILT_INVERT:
+		return 1.0f - v;
+	case FILT_WOOD:
+		return remainderf_py(v, f->arg) / f->arg;
+	case FILT_CENTER:
+		return 1.0f - (fabsf(v - 0.5f) * 2.0f);
+	default:
+		return v;
+	}
+}
+
+// Whether rows need any work between the kernel and the output buffer
+static inline int
+output_is_raw(const perlin_output *o)
+{
+	return o->type == NPY_FLOAT && !o->normalise && o->nfilters == 0;
+}
+
+static inline size_t
+output_elsize(const perlin_output *o)
+{
+	return o->type == NPY_UINT8 ? 1 : o->type == NPY_INT16 ? sizeof(short) : sizeof(float);
+}
+
+// Write n post-processed values from v to dest, which may be v itself for
+// float32 output.
+static void
+store_row(const perlin_output *o, const float *v, const npy_intp n, void *dest)
+{
+	npy_intp m;
+	if (o->type == NPY_UINT8) {
+		unsigned char *d = (unsigned char*)dest;
+		for (m = 0; m < n; m++) {
+			const float q = v[m] * 255;
+			d[m] = q <= 0 ? 0 : q >= 255 ? 255 : (unsigned char)q;
+		}
+	} else if (o->type == NPY_INT16) {
+		short *d = (short*)dest;
+		for (m = 0; m < n; m++) {
+			const float q = v[m] * FIXED_ONE;
+			d[m] = q <= -32768 ? -32768 : q >= 32767 ? 32767 : (short)(q < 0 ? q - .5f : q + .5f);
+		}
+	} else if ((float*)dest != v)
+		memcpy(dest, v, sizeof(float)*n);
+}
+
+// Post-process n values from v (modified in place) into dest, which may be
+// v itself for float32 output.  There must be no blur filters.
+static void
+postprocess_row(const perlin_output *o, float *v, const int n, void *dest)
+{
+	int m, f;
+	if (o->normalise)
+		for (m = 0; m < n; m++) {
+			v[m] -= o->min;
+			v[m] *= o->scale;
+		}
+	for (f = 0; f < o->nfilters; f++)
+		for (m = 0; m < n; m++)
+			v[m] = apply_filter(&o->filters[f], v[m]);
+	store_row(o, v, n, dest);
+}
+
+// Gaussian blur with periodic boundaries, as scipy.ndimage.gaussian_filter
+// with mode="wrap": the y and then the x axis are correlated with the
+// kernel truncated at 4 sigma, accumulating in double precision in the
+// same order as scipy and rounding to float32 after each axis.  Differences
+// from scipy are limited to the last bit of the normalised weights.
+static inline int
+gaussian_radius(const float sigma)
+{
+	return sigma > 1e-15 ? (int)(4.0*sigma + 0.5) : 0;
+}
+
+// Per-thread buffers for blur_frame, for kernels up to the given radius
+typedef struct {
+	float *frame;   // A copy of the frame
+	double *line;   // One row, extended by radius at each end
+	double *acc;    // One row of sums
+	double *w;      // The kernel, w[k] for offset +-k
+} blur_scratch;
+
+static int
+blur_scratch_alloc(blur_scratch *b, const int ny, const int nx, const int radius)
+{
+	b->frame = (float*)malloc(sizeof(float)*(size_t)ny*nx);
+	b->line = (double*)malloc(sizeof(double)*((size_t)nx + 2*(size_t)radius));
+	b->acc = (double*)malloc(sizeof(double)*(size_t)nx);
+	b->w = (double*)malloc(sizeof(double)*((size_t)radius + 1));
+	if (!b->frame || !b->line || !b->acc || !b->w)
+		return -1;
+	return 0;
+}
+
+static void
+blur_scratch_free(blur_scratch *b)
+{
+	free(b->frame);
+	free(b->line);
+	free(b->acc);
+	free(b->w);
+}
+
+static inline int
+wrap_index(const npy_intp i, const int n)
+{
+	const int r = (int)(i % n);
+	return r < 0 ? r + n : r;
+}
+
+// Blur the (ny,nx) frame v in place
+static void
+blur_frame(float *v, const int ny, const int nx, const float sigma, blur_scratch *b)
+{
+	const int radius = gaussian_radius(sigma);
+	double *w = b->w, *acc = b->acc, *line = b->line;
+	const double c = -0.5 / ((double)sigma*sigma);
+	double sum = 0;
+	int i, k, m;
+	if (sigma <= 1e-15)
+		return;
+	for (k = -radius; k <= radius; k++)
+		sum += exp(c * ((double)k*k));
+	for (k = 0; k <= radius; k++)
+		w[k] = exp(c * ((double)k*k)) / sum;
+	// Along y, one output row at a time from a copy of the frame
+	memcpy(b->frame, v, sizeof(float)*(size_t)ny*nx);
+	for (i = 0; i < ny; i++) {
+		const float *row = b->frame + (size_t)i*nx;
+		for (m = 0; m < nx; m++)
+			acc[m] = row[m] * w[0];
+		for (k = radius; k > 0; k--) {
+			const float *lo = b->frame + (size_t)wrap_index((npy_intp)i - k, ny)*nx;
+			const float *hi = b->frame + (size_t)wrap_index((npy_intp)i + k, ny)*nx;
+			for (m = 0; m < nx; m++)
+				acc[m] += ((double)lo[m] + (double)hi[m]) * w[k];
+		}
+		for (m = 0; m < nx; m++)
+			v[(size_t)i*nx + m] = (float)acc[m];
+	}
+	// Along x, one row at a time
+	for (i = 0; i < ny; i++) {
+		float *row = v + (size_t)i*nx;
+		for (m = 0; m < nx + 2*radius; m++)
+			line[m] = row[wrap_index((npy_intp)m - radius, nx)];
+		for (m = 0; m < nx; m++)
+			acc[m] = line[m + radius] * w[0];
+		for (k = radius; k > 0; k--)
+			for (m = 0; m < nx; m++)
+				acc[m] += (line[m + radius - k] + line[m + radius + k]) * w[k];
+		for (m = 0; m < nx; m++)
+			row[m] = (float)acc[m];
+	}
+}
+
+// Post-process one (ny,nx) frame from v (modified in place) into dest.
+// Unlike postprocess_row, this supports blur filters.
+static void
+postprocess_frame(const perlin_output *o, float *v, const int ny, const int nx,
+	blur_scratch *b, void *dest)
+{
+	const npy_intp n = (npy_intp)ny*nx;
+	npy_intp m;
+	int f;
+	if (o->normalise)
+		for (m = 0; m < n; m++) {
+			v[m] -= o->min;
+			v[m] *= o->scale;
+		}
+	for (f = 0; f < o->nfilters; f++) {
+		if (o->filters[f].op == FILT_BLUR)
+			blur_frame(v, ny, nx, o->filters[f].arg, b);
+		else
+			for (m = 0; m < n; m++)
+				v[m] = apply_filter(&o->filters[f], v[m]);
+	}
+	store_row(o, v, n, dest);
+}
+
+// Fill o from the Python filters and norm arguments (either may be NULL or
+// None, and an empty filter list is the same as None) for output of the
+// given type.  filters is a list in the same format as for
+// PerlinStimulus.save_video.  Without either, uint8 output maps [-1,1] onto
+// [0,255].  Returns -1 with an exception set on failure.
+static int
+parse_output(PyObject *filters, PyObject *norm, const int type, perlin_output *o)
+{
+  Py_ssize_t i, n;
+  o->type = type;
+  o->normalise = 0;
+  o->nfilters = 0;
+  o->nblur = 0;
+  o->blur_radius = 0;
+  if (filters == Py_None || (PySequence_Check(filters) && PySequence_Size(filters) == 0))
+    filters = NULL;
+  if (norm == Py_None)
+    norm = NULL;
+  if (norm) {
+    float min, max;
+    if (!PyArg_ParseTuple(norm, "ff:norm", &min, &max))
+      return -1;
+    if (!(max > min)) {
+      PyErr_SetString(PyExc_ValueError, "norm must be (min, max) with max > min");
+      return -1;
+    }
+    o->normalise = 1;
+    o->min = min;
+    o->scale = 1/(max - min);
+  } else if (!filters && type == NPY_UINT8) {
+    o->normalise = 1;
+    o->min = -1.0f;
+    o->scale = 0.5f;
+  }
+  if (type == NPY_INT16 && (norm || filters)) {
+    PyErr_SetString(PyExc_ValueError, "int16 output does not support filters or norm");
+    return -1;
+  }
+  if (!filters)
+    return 0;
+  if (!PySequence_Check(filters)) {
+    PyErr_SetString(PyExc_TypeError, "filters must be a list");
+    return -1;
+  }
+  n = PySequence_Size(filters);
+  if (n > MAX_FILTERS) {
+    PyErr_SetString(PyExc_ValueError, "Too many filters");
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    PyObject *f = PySequence_GetItem(filters, i);
+    PyObject *name = f;
+    Py_ssize_t nargs = 0;
+    const char *s;
+    int k;
+    if (!f)
+      return -1;
+    if (PyTuple_Check(f)) {
+      nargs = PyTuple_GET_SIZE(f) - 1;
+      name = nargs >= 0 ? PyTuple_GET_ITEM(f, 0) : NULL;
+    }
+    s = name && PyUnicode_Check(name) ? PyUnicode_AsUTF8(name) : NULL;
+    for (k = 0; s && FILTER_NAMES[k].name; k++)
+      if (strcmp(s, FILTER_NAMES[k].name) == 0)
+        break;
+    if (!s || !FILTER_NAMES[k].name) {
+      Py_DECREF(f);
+      if (!PyErr_Occurred())
+        PyErr_SetString(PyExc_ValueError, "Invalid filter specified, or filter not supported in C");
+      return -1;
+    }
+    if (nargs != FILTER_NAMES[k].nargs) {
+      Py_DECREF(f);
+      PyErr_Format(PyExc_ValueError, "Filter %s takes %d argument(s)", s, FILTER_NAMES[k].nargs);
+      return -1;
+    }
+    o->filters[o->nfilters].op = FILTER_NAMES[k].op;
+    o->filters[o->nfilters].arg = 0;
+    if (nargs) {
+      o->filters[o->nfilters].arg = (float)PyFloat_AsDouble(PyTuple_GET_ITEM(f, 1));
+      if (PyErr_Occurred()) {
+        Py_DECREF(f);
+        return -1;
+      }
+    }
+    Py_DECREF(f);
+    if (FILTER_NAMES[k].op == FILT_BLUR) {
+      const int radius = gaussian_radius(o->filters[o->nfilters].arg);
+      if (o->filters[o->nfilters].arg < 0) {
+        PyErr_SetString(PyExc_ValueError, "Blur sigma must be >= 0");
+        return -1;
+      }
+      o->nblur++;
+      if (radius > o->blur_radius)
+        o->blur_radius = radius;
+    }
+    if (FILTER_NAMES[k].op != FILT_REVERSE)
+      o->nfilters++;
+  }
+  return 0;
+}
+
+// parse_output for perlin_grid, which works a row at a time and so cannot
+// blur.
+static int
+parse_grid_output(PyObject *filters, PyObject *norm, const int type, perlin_output *o)
+{
+  if (parse_output(filters, norm, type, o) < 0)
+    return -1;
+  if (o->nblur) {
+    PyErr_SetString(PyExc_ValueError, "The blur filter is only supported by postprocess");
+    return -1;
+  }
+  return 0;
+}
+
+// Fill ret with the noise on the grid described by L, restricted to the z
+// indices z0 to z1-1, post-processed as described by o.  Unless the output
+// is raw float32, rows are computed into a per-thread scratch row, so no
+// full-size intermediate is needed.  Rows of fixed-point lattices are
+// converted to float32 for post-processing, except for int16 output, which
+// the kernel writes directly.  The grid is split into rows along the
+// innermost axis, which are shared out between the worker threads, so this
+// must not touch any Python objects.  Returns -1 if out of memory.
+static int
+perlin_grid(const perlin_lattice *L, const int layout, const int z0, const int z1,
+	void *ret, const perlin_output *o, int threads)
+{
+	// Each axis has fewer than 2^31 elements, but the grid may not
+	npy_intp r;
+	const int len_y = L->len_y;
+	const npy_intp nrows = layout == LAYOUT_ZYX ? (npy_intp)(z1 - z0)*len_y : (npy_intp)L->len_x*len_y;
+	const int rowlen = layout == LAYOUT_ZYX ? L->len_x : z1 - z0;
+	const size_t elsize = output_elsize(o);
+	const int raw = output_is_raw(o);
+	// Per thread, a float32 row unless the output is raw float32, and for
+	// fixed point the corner hashes of each cell along the row's axis, then
+	// a fixed-point row unless the kernel writes to the output
+	const size_t fsize = raw ? 0 : sizeof(float)*(size_t)rowlen;
+	const size_t hsize = L->fixed ? sizeof(unsigned int)*(size_t)(layout == LAYOUT_ZYX ? L->len_x : L->len_z) : 0;
+	const size_t qsize = hsize + (L->fixed && o->type != NPY_INT16 ? sizeof(short)*(size_t)rowlen : 0);
+	char *scratch = NULL;
+#ifdef _OPENMP
+	if (threads <= 0)
+		threads = omp_get_max_threads();
+#else
+	threads = 1;
+#endif
+	if (fsize + qsize) {
+		scratch = (char*)malloc((fsize + qsize)*threads);
+		if (!scratch)
+			return -1;
+	}
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) num_threads(threads)
+#endif
+	for (r = 0; r < nrows; r++) {
+		char *dest = (char*)ret + elsize*(size_t)r*rowlen;
+#ifdef _OPENMP
+		char *mine = scratch + (fsize + qsize)*omp_get_thread_num();
+#else
+		char *mine = scratch;
+#endif
+		float *row = raw ? (float*)dest : (float*)mine;
+		const int outer = layout == LAYOUT_ZYX ? z0 + (int)(r / len_y) : (int)(r / len_y);
+		const int start = layout == LAYOUT_ZYX ? 0 : z0;
+		if (L->fixed) {
+			short *q = qsize > hsize ? (short*)(mine + fsize + hsize) : (short*)dest;
+			int m;
+			perlin_row_fixed(L, layout, outer, (int)(r % len_y), start, start + rowlen, q,
+				(unsigned int*)(mine + fsize));
+			if (qsize == hsize)
+				continue;
+			for (m = 0; m < rowlen; m++)
+				row[m] = q[m] * (1.0f / FIXED_ONE);
+		} else
+			perlin_row(L, layout, outer, (int)(r % len_y), start, start + rowlen, row);
+		if (!raw)
+			postprocess_row(o, row, rowlen, dest);
+	}
+	free(scratch);
+	return 0;
+}
+
+// Variants of one grid which differ only in base and persistence.  The
+// persistence only enters through the amplitude of each octave, so the
+// variants with the same base share a lattice, and each octave is evaluated
+// once per sample and summed into all of them.
+typedef struct {
+	int nvariants, nlattices;
+	perlin_lattice *L;  // One per base, with as many octaves as its variants need
+	int *lattice;       // Index into L of each variant
+	int *levels;        // Number of octaves of each variant
+	float *amp;         // Amplitudes of the octaves, maxlevels for each variant
+	float *max;         // Sum of the amplitudes of each variant
+	int maxlevels;
+} perlin_batch;
+
+static void
+batch_free(perlin_batch *B)
+{
+	int g;
+	for (g = 0; g < B->nlattices; g++)
+		lattice_free(&B->L[g]);
+	free(B->L);
+	free(B->lattice);
+	free(B->levels);
+	free(B->amp);
+	free(B->max);
+	memset(B, 0, sizeof(*B));
+}
+
+// perlin_grid for every variant in B, writing each one's output after the
+// other's in ret.  Each variant is summed in the same order as by
+// perlin_grid, so it is identical to calling make_perlin for each.
+// Returns -1 if out of memory.
+static int
+perlin_grid_batch(const perlin_batch *B, const int layout, const int z0, const int z1,
+	void *ret, const perlin_output *o, int threads)
+{
+	npy_intp r;
+	const int len_y = B->L[0].len_y, single = B->L[0].single;
+	const npy_intp nrows = layout == LAYOUT_ZYX ? (npy_intp)(z1 - z0)*len_y : (npy_intp)B->L[0].len_x*len_y;
+	const int rowlen = layout == LAYOUT_ZYX ? B->L[0].len_x : z1 - z0;
+	const size_t elsize = output_elsize(o);
+	// One row for the octave being evaluated and one for each variant
+	const size_t per_thread = (size_t)rowlen*(B->nvariants + 1);
+	float *scratch;
+#ifdef _OPENMP
+	if (threads <= 0)
+		threads = omp_get_max_threads();
+#else
+	threads = 1;
+#endif
+	scratch = (float*)malloc(sizeof(float)*per_thread*threads);
+	if (!scratch)
+		return -1;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) num_threads(threads)
+#endif
+	for (r = 0; r < nrows; r++) {
+#ifdef _OPENMP
+		float *octave = scratch + per_thread*omp_get_thread_num();
+#else
+		float *octave = scratch;
+#endif
+		const int outer = layout == LAYOUT_ZYX ? z0 + (int)(r / len_y) : (int)(r / len_y);
+		const int j = (int)(r % len_y);
+		const int start = layout == LAYOUT_ZYX ? 0 : z0;
+		int g, l, v, m;
+		for (g = 0; g < B->nlattices; g++) {
+			const perlin_lattice *L = &B->L[g];
+			for (l = 0; l < L->levels; l++) {
+				// Octave l on its own, as noise3 returns it
+				perlin_lattice one = *L;
+				one.x += l;
+				one.y += l;
+				one.z += l;
+				one.amp += l;
+				one.levels = 1;
+				one.single = 1;
+				perlin_row(&one, layout, outer, j, start, start + rowlen, octave);
+				for (v = 0; v < B->nvariants; v++) {
+					float *total = octave + (size_t)rowlen*(v + 1);
+					const float amp = B->amp[(size_t)B->maxlevels*v + l];
+					if (B->lattice[v] != g || l >= B->levels[v])
+						continue;
+					if (single)
+						memcpy(total, octave, sizeof(float)*rowlen);
+					else if (l == 0)
+						for (m = 0; m < rowlen; m++)
+							total[m] = 0.0f + octave[m] * amp;
+					else
+						for (m = 0; m < rowlen; m++)
+							total[m] += octave[m] * amp;
+				}
+			}
+		}
+		for (v = 0; v < B->nvariants; v++) {
+			float *total = octave + (size_t)rowlen*(v + 1);
+			char *dest = (char*)ret + elsize*((size_t)nrows*rowlen*v + (size_t)r*rowlen);
+			if (!single)
+				for (m = 0; m < rowlen; m++)
+					total[m] = (float) (total[m] / B->max[v]);
+			postprocess_row(o, total, rowlen, dest);
+		}
+	}
+	free(scratch);
+	return 0;
+}
+
+// Totals over all calls, for profiling.  They are only updated once per call
+// and while holding the GIL, so they are cheap enough to always be on.
+static struct {
+	unsigned long long grid_calls, grid_samples, postprocess_calls, postprocess_samples;
+	double grid_seconds, postprocess_seconds;
+} counters;
+
+static double
+wall_seconds(void)
+{
+#ifdef _OPENMP
+	return omp_get_wtime();
+#elif defined(_WIN32)
+	LARGE_INTEGER t, f;
+	QueryPerformanceCounter(&t);
+	QueryPerformanceFrequency(&f);
+	return (double)t.QuadPart / (double)f.QuadPart;
+#else
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 1e-9*t.tv_nsec;
+#endif
+}
+
+// Check that out can be written to directly as an output of shape dims.
+// Returns its type, or -1 with an exception set.
+static int
+check_out(PyObject *out, const int ndim, const npy_intp *dims)
+{
+  PyArrayObject *o = (PyArrayObject*)out;
+  int ok = PyArray_Check(out) && (PyArray_TYPE(o) == NPY_FLOAT || PyArray_TYPE(o) == NPY_UINT8 || PyArray_TYPE(o) == NPY_INT16)
+    && PyArray_ISCARRAY(o) && PyArray_NDIM(o) == ndim;
+  int d;
+  for (d = 0; ok && d < ndim; d++)
+    ok = PyArray_DIM(o, d) == dims[d];
+  if (!ok) {
+    PyErr_SetString(PyExc_ValueError, "out must be a writable C-contiguous float32, uint8 or int16 array of the output shape");
+    return -1;
+  }
+  return PyArray_TYPE(o);
+}
+
+static inline float
+half_to_float(const unsigned short h)
+{
+	const unsigned int sign = (h & 0x8000u) << 16;
+	unsigned int exp = (h >> 10) & 0x1f;
+	unsigned int mant = h & 0x3ff;
+	unsigned int bits;
+	float f;
+	if (exp == 0x1f)
+		bits = sign | 0x7f800000u | (mant << 13);
+	else if (exp)
+		bits = sign | ((exp + 112) << 23) | (mant << 13);
+	else if (mant) { // Subnormal
+		exp = 113;
+		while (!(mant & 0x400)) {
+			mant <<= 1;
+			exp--;
+		}
+		bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+	} else
+		bits = sign;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+#define POSTPROCESS_CHUNK 4096
+
+// Convert len values of src, starting at start, to float32 in buf, then
+// subtract the mean sub (of size msize, repeated) if there is one.
+static void
+load_values(const int type, const void *src, const npy_intp start, const npy_intp len,
+	const float *sub, const npy_intp msize, float *buf)
+{
+  npy_intp m;
+  if (type == NPY_HALF)
+    for (m = 0; m < len; m++)
+      buf[m] = half_to_float(((const unsigned short*)src)[start + m]);
+  else if (type == NPY_UINT16)
+    for (m = 0; m < len; m++)
+      buf[m] = (float)((const unsigned short*)src)[start + m];
+  else if (type == NPY_UINT8)
+    for (m = 0; m < len; m++)
+      buf[m] = (float)((const unsigned char*)src)[start + m];
+  else
+    memcpy(buf, (const float*)src + start, sizeof(float)*len);
+  if (sub) {
+    npy_intp p = start % msize;
+    for (m = 0; m < len; m++) {
+      buf[m] -= sub[p];
+      if (++p == msize)
+        p = 0;
+    }
+  }
+}
+
+// The body of postprocess without blur filters, in fixed-size chunks
+static void
+postprocess_chunks(const perlin_output *o, const int type, const void *src, const npy_intp n,
+  const float *sub, const npy_intp msize, char *dest, int threads)
+{
+  const size_t elsize = output_elsize(o);
+  const npy_intp nchunks = (n + POSTPROCESS_CHUNK - 1) / POSTPROCESS_CHUNK;
+  npy_intp c;
+#ifdef _OPENMP
+  if (threads <= 0)
+    threads = omp_get_max_threads();
+#pragma omp parallel for schedule(static) num_threads(threads)
+#endif
+  for (c = 0; c < nchunks; c++) {
+    float buf[POSTPROCESS_CHUNK];
+    const npy_intp start = c*POSTPROCESS_CHUNK;
+    const int len = (int)(n - start < POSTPROCESS_CHUNK ? n - start : POSTPROCESS_CHUNK);
+    load_values(type, src, start, len, sub, msize, buf);
+    postprocess_row(o, buf, len, dest + elsize*start);
+  }
+}
+
+// postprocess with blur filters, one (ny,nx) frame at a time.  Returns -1
+// if out of memory.
+static int
+postprocess_frames(const perlin_output *o, const int type, const void *src, const npy_intp n,
+  const int ny, const int nx, const float *sub, const npy_intp msize, char *dest, int threads)
+{
+  const npy_intp fsize = (npy_intp)ny*nx, nframes = n / fsize;
+  const size_t elsize = output_elsize(o);
+  blur_scratch *scratch;
+  float *bufs;
+  npy_intp c;
+  int t, err = 0;
+#ifdef _OPENMP
+  if (threads <= 0)
+    threads = omp_get_max_threads();
+#else
+  threads = 1;
+#endif
+  if (nframes < threads)
+    threads = nframes > 0 ? (int)nframes : 1;
+  scratch = (blur_scratch*)calloc(threads, sizeof(blur_scratch));
+  bufs = (float*)malloc(sizeof(float)*(size_t)fsize*threads);
+  for (t = 0; scratch && t < threads && !err; t++)
+    err = blur_scratch_alloc(&scratch[t], ny, nx, o->blur_radius);
+  if (!scratch || !bufs || err) {
+    for (t = 0; scratch && t < threads; t++)
+      blur_scratch_free(&scratch[t]);
+    free(scratch);
+    free(bufs);
+    return -1;
+  }
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+#endif
+  for (c = 0; c < nframes; c++) {
+#ifdef _OPENMP
+    const int th = omp_get_thread_num();
+#else
+    const int th = 0;
+#endif
+    float *buf = bufs + (size_t)fsize*th;
+    load_values(type, src, c*fsize, fsize, sub, msize, buf);
+    postprocess_frame(o, buf, ny, nx, &scratch[th], dest + elsize*(size_t)(c*fsize));
+  }
+  for (t = 0; t < threads; t++)
+    blur_scratch_free(&scratch[t]);
+  free(scratch);
+  free(bufs);
+  return 0;
+}
+
+static PyObject *
+postprocess(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+  PyObject *__arr, *out = Py_None, *filters = Py_None, *norm = Py_None, *__mean = Py_None;
+  PyArrayObject *arr, *mean = NULL;
+  perlin_output o;
+  int threads = 0;
+	static char *kwlist[] = {"arr", "filters", "norm", "out", "threads", "mean", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OOOiO:postprocess", kwlist,
+    &__arr, &filters, &norm, &out, &threads, &__mean))
+		return NULL;
+  if (threads < 0) {
+    PyErr_SetString(PyExc_ValueError, "Expected threads value >= 0");
+    return NULL;
+  }
+  // float16 and quantised uint8/uint16 caches are read directly, anything
+  // else is converted to float32
+  const int in_type = PyArray_Check(__arr) ? PyArray_TYPE((PyArrayObject*)__arr) : NPY_FLOAT;
+  if ((in_type == NPY_HALF || in_type == NPY_UINT8 || in_type == NPY_UINT16)
+      && PyArray_IS_C_CONTIGUOUS((PyArrayObject*)__arr)) {
+    Py_INCREF(__arr);
+    arr = (PyArrayObject*)__arr;
+  } else {
+    arr = (PyArrayObject*)PyArray_FROMANY(__arr, NPY_FLOAT, 0, 0, NPY_ARRAY_C_CONTIGUOUS);
+    if (!arr)
+      return NULL;
+  }
+  const int ndim = PyArray_NDIM(arr);
+  npy_intp *dims = PyArray_DIMS(arr);
+  const npy_intp n = PyArray_SIZE(arr);
+  // The mean is subtracted before anything else, repeating it over the
+  // leading dimensions, e.g. a (y,x) spatial mean for (t,y,x) frames.
+  npy_intp msize = 0;
+  if (__mean != Py_None) {
+    mean = (PyArrayObject*)PyArray_FROMANY(__mean, NPY_FLOAT, 0, 0, NPY_ARRAY_C_CONTIGUOUS);
+    if (!mean) {
+      Py_DECREF(arr);
+      return NULL;
+    }
+    msize = PyArray_SIZE(mean);
+    if (msize == 0 || n % msize != 0) {
+      PyErr_SetString(PyExc_ValueError, "mean must have the shape of the trailing dimensions of arr");
+      Py_DECREF(arr);
+      Py_DECREF(mean);
+      return NULL;
+    }
+  }
+  int out_type = NPY_UINT8;
+  if (out != Py_None)
+    out_type = check_out(out, ndim, dims);
+  if (out_type < 0 || parse_output(filters, norm, out_type, &o) < 0) {
+    Py_DECREF(arr);
+    Py_XDECREF(mean);
+    return NULL;
+  }
+  if (out == Py_None) {
+    out = PyArray_SimpleNew(ndim, dims, NPY_UINT8);
+    if (!out) {
+      Py_DECREF(arr);
+      Py_XDECREF(mean);
+      return NULL;
+    }
+  } else
+    Py_INCREF(out);
+  const int type = PyArray_TYPE(arr);
+  const void *src = PyArray_DATA(arr);
+  char *dest = (char*)PyArray_DATA((PyArrayObject*)out);
+  const float *sub = mean ? (const float*)PyArray_DATA(mean) : NULL;
+  const double t0 = wall_seconds();
+  int err = 0;
+  if (o.nblur && ndim < 2) {
+    PyErr_SetString(PyExc_ValueError, "The blur filter needs frames with at least 2 dimensions");
+    goto fail;
+  }
+  Py_BEGIN_ALLOW_THREADS
+  if (!o.nblur)
+    postprocess_chunks(&o, type, src, n, sub, msize, dest, threads);
+  else if (n > 0) // Blurs need whole frames, i.e. the last two dimensions
+    err = postprocess_frames(&o, type, src, n, (int)dims[ndim-2], (int)dims[ndim-1], sub, msize, dest, threads);
+  Py_END_ALLOW_THREADS
+  if (err < 0) {
+    PyErr_NoMemory();
+    goto fail;
+  }
+  counters.postprocess_calls++;
+  counters.postprocess_samples += (unsigned long long)n;
+  counters.postprocess_seconds += wall_seconds() - t0;
+  Py_DECREF(arr);
+  Py_XDECREF(mean);
+  return out;
+fail:
+  Py_DECREF(out);
+  Py_DECREF(arr);
+  Py_XDECREF(mean);
+  return NULL;
+}
+
+static void
+default_params(perlin_params *p)
+{
+	p->octaves = 1;
+	p->persistence = 0.5f;
+	p->lacunarity = 2.0f;
+	p->repeatx = 1024; // arbitrary
+	p->repeaty = 1024; // arbitrary
+	p->repeatz = 1024; // arbitrary
+	p->base = 0;
+	p->fixed = 0;
+}
+
+// Set p->fixed from the name of a precision.  Returns -1 with an exception
+// set if it is unknown.
+static int
+parse_precision(const char *name, perlin_params *p)
+{
+  if (strcmp(name, "float32") == 0)
+    p->fixed = 0;
+  else if (strcmp(name, "fixed16") == 0)
+    p->fixed = 1;
+  else {
+    PyErr_SetString(PyExc_ValueError, "Precision must be 'float32' or 'fixed16'");
+    return -1;
+  }
+  return 0;
+}
+
+// Check the parameters and build the lattice tables for the grid spanned by
+// the Python objects __x, __y and __z.  Returns -1 with an exception set on
+// failure.
+static int
+grid_setup(PyObject *__x, PyObject *__y, PyObject *__z, const perlin_params *p,
+	const int threads, perlin_lattice *L)
+{
+  PyArrayObject *_x = NULL, *_y = NULL, *_z = NULL;
+  float *x, *y, *z;
+  int ret = -1;
+  if (p->base < 0 || p->base > 255) {
+    PyErr_SetString(PyExc_ValueError, "Base must be between 0 and 255");
+    return -1;
+  }
+	if (p->octaves < 1) {
+		PyErr_SetString(PyExc_ValueError, "Expected octaves value > 0");
+		return -1;
+	}
+  if (threads < 0) {
+    PyErr_SetString(PyExc_ValueError, "Expected threads value >= 0");
+    return -1;
+  }
+  _x = (PyArrayObject*)PyArray_FROMANY(__x, NPY_FLOAT, 1, 1, NPY_ARRAY_C_CONTIGUOUS);
+  _y = (PyArrayObject*)PyArray_FROMANY(__y, NPY_FLOAT, 1, 1, NPY_ARRAY_C_CONTIGUOUS);
+  _z = (PyArrayObject*)PyArray_FROMANY(__z, NPY_FLOAT, 1, 1, NPY_ARRAY_C_CONTIGUOUS);
+  if (!_x || !_y || !_z)
+    goto done;
+  x = (float*)PyArray_DATA(_x);
+  y = (float*)PyArray_DATA(_y);
+  z = (float*)PyArray_DATA(_z);
+  const npy_intp nx = PyArray_SIZE(_x), ny = PyArray_SIZE(_y), nz = PyArray_SIZE(_z);
+  // The grid as a whole is indexed with npy_intp, but each axis with int
+  if (nx < 1 || ny < 1 || nz < 1 || nx > INT_MAX || ny > INT_MAX || nz > INT_MAX) {
+    PyErr_SetString(PyExc_ValueError, "x, y and z must each have between 1 and 2^31-1 elements");
+    goto done;
+  }
+  const int len_x = (int)nx, len_y = (int)ny, len_z = (int)nz;
+  if (x[len_x-1] >= p->repeatx || y[len_y-1] >= p->repeaty || z[len_z-1] >= p->repeatz) {
+		PyErr_SetString(PyExc_ValueError, "Cannot pass values greater than repeatx/y/z");
+    goto done;
+  }
+  if (lattice_build(L, x, y, z, len_x, len_y, len_z, p) < 0) {
+    PyErr_NoMemory();
+    goto done;
+  }
+  ret = 0;
+done:
+  Py_XDECREF(_x);
+  Py_XDECREF(_y);
+  Py_XDECREF(_z);
+  return ret;
+}
+
+static PyObject *
+make_perlin(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	perlin_params p;
+	perlin_lattice L;
+	int threads = 0;
+	const char *layout_name = "xyz", *precision = "float32";
+	int layout;
+  PyObject *__x, *__y, *__z;
+  PyObject *out = Py_None, *filters = Py_None, *norm = Py_None;
+  perlin_output o;
+	default_params(&p);
+
+	static char *kwlist[] = {"x", "y", "z", "octaves", "persistence", "lacunarity",
+		"repeatx", "repeaty", "repeatz", "base", "threads", "layout", "out", "filters", "norm", "precision", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOO|iffiiiiisOOOs:make_perlin", kwlist,
+		&__x, &__y, &__z, &p.octaves, &p.persistence, &p.lacunarity, &p.repeatx, &p.repeaty, &p.repeatz, &p.base, &threads,
+		&layout_name, &out, &filters, &norm, &precision))
+		return NULL;
+  if (parse_precision(precision, &p) < 0)
+    return NULL;
+  if (strcmp(layout_name, "xyz") == 0)
+    layout = LAYOUT_XYZ;
+  else if (strcmp(layout_name, "zyx") == 0)
+    layout = LAYOUT_ZYX;
+  else {
+    PyErr_SetString(PyExc_ValueError, "Layout must be 'xyz' or 'zyx'");
+    return NULL;
+  }
+  if (grid_setup(__x, __y, __z, &p, threads, &L) < 0)
+    return NULL;
+  const int len_x = L.len_x, len_y = L.len_y, len_z = L.len_z;
+  npy_intp dims[3] = { len_x, len_y, len_z };
+  if (layout == LAYOUT_ZYX) {
+    dims[0] = len_z;
+    dims[2] = len_x;
+  }
+  int out_type = NPY_FLOAT;
+  void *ret;
+  if (out != Py_None)
+    out_type = check_out(out, 3, dims);
+  if (out_type < 0 || parse_grid_output(filters, norm, out_type, &o) < 0) {
+    lattice_free(&L);
+    return NULL;
+  }
+  if (out != Py_None)
+    ret = PyArray_DATA((PyArrayObject*)out);
+  else {
+    const double n = (double)len_x*len_y*len_z;
+    ret = n*sizeof(float) > (double)SIZE_MAX ? NULL : malloc(sizeof(float)*(size_t)n);
+    if (!ret) {
+      lattice_free(&L);
+      return PyErr_NoMemory();
+    }
+  }
+
+  // The kernel only reads the lattice tables, so other Python threads may
+  // run while it works.
+  int err;
+  const double t0 = wall_seconds();
+  Py_BEGIN_ALLOW_THREADS
+  err = perlin_grid(&L, layout, 0, len_z, ret, &o, threads);
+  Py_END_ALLOW_THREADS
+  counters.grid_calls++;
+  counters.grid_samples += (unsigned long long)len_x*len_y*len_z;
+  counters.grid_seconds += wall_seconds() - t0;
+  lattice_free(&L);
+  if (err < 0) {
+    if (out == Py_None)
+      free(ret);
+    return PyErr_NoMemory();
+  }
+
+  if (out != Py_None) {
+    Py_INCREF(out);
+    return out;
+  }
+  PyObject *retarray = PyArray_SimpleNewFromData(3, dims, NPY_FLOAT, ret);
+  if (!retarray) {
+    free(ret);
+    return NULL;
+  }
+  PyArray_ENABLEFLAGS((PyArrayObject*)retarray, NPY_ARRAY_OWNDATA);
+  return retarray;
+}
+
+// Read the per-variant arguments of make_perlin_batch.  Returns the number
+// of variants, or -1 with an exception set.
+static int
+batch_variants(PyObject *__bases, PyObject *__persistences, int **bases, float **persistences)
+{
+  PyObject *b = PySequence_Fast(__bases, "bases must be a sequence");
+  PyObject *q = b ? PySequence_Fast(__persistences, "persistences must be a sequence") : NULL;
+  int n = -1, v;
+  *bases = NULL;
+  *persistences = NULL;
+  if (!b || !q)
+    goto done;
+  const Py_ssize_t nb = PySequence_Fast_GET_SIZE(b), nq = PySequence_Fast_GET_SIZE(q);
+  const Py_ssize_t nv = nb > nq ? nb : nq;
+  if (nb < 1 || nq < 1 || (nb != nq && nb != 1 && nq != 1) || nv > INT_MAX) {
+    PyErr_SetString(PyExc_ValueError, "bases and persistences must have the same length, or length 1");
+    goto done;
+  }
+  *bases = (int*)malloc(sizeof(int)*nv);
+  *persistences = (float*)malloc(sizeof(float)*nv);
+  if (!*bases || !*persistences) {
+    PyErr_NoMemory();
+    goto done;
+  }
+  for (v = 0; v < nv; v++) {
+    const long base = PyLong_AsLong(PySequence_Fast_GET_ITEM(b, nb == 1 ? 0 : v));
+    const double persistence = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(q, nq == 1 ? 0 : v));
+    if (PyErr_Occurred())
+      goto done;
+    if (base < 0 || base > 255) {
+      PyErr_SetString(PyExc_ValueError, "Base must be between 0 and 255");
+      goto done;
+    }
+    (*bases)[v] = (int)base;
+    (*persistences)[v] = (float)persistence;
+  }
+  n = (int)nv;
+done:
+  if (n < 0) {
+    free(*bases);
+    free(*persistences);
+    *bases = NULL;
+    *persistences = NULL;
+  }
+  Py_XDECREF(b);
+  Py_XDECREF(q);
+  return n;
+}
+
+// Set up the variants of the grid __x/__y/__z, with one lattice for each
+// distinct base.  Lattices of different bases are built independently, as
+// only the per-sample work of variants with the same base can be shared.  Returns -1 with an exception set on failure.
+static int
+batch_setup(PyObject *__x, PyObject *__y, PyObject *__z, const perlin_params *p,
+  const int *bases, const float *persistences, const int n, const int threads, perlin_batch *B)
+{
+  int v, w, l;
+  memset(B, 0, sizeof(*B));
+  B->nvariants = n;
+  B->L = (perlin_lattice*)calloc(n, sizeof(perlin_lattice));
+  B->lattice = (int*)malloc(sizeof(int)*n);
+  B->levels = (int*)malloc(sizeof(int)*n);
+  B->max = (float*)malloc(sizeof(float)*n);
+  if (!B->L || !B->lattice || !B->levels || !B->max)
+    goto nomem;
+  for (v = 0; v < n; v++) {
+    B->levels[v] = octave_levels(p->octaves, persistences[v]);
+    if (B->levels[v] > B->maxlevels)
+      B->maxlevels = B->levels[v];
+  }
+  B->amp = (float*)malloc(sizeof(float)*(size_t)n*B->maxlevels);
+  if (!B->amp)
+    goto nomem;
+  for (v = 0; v < n; v++) {
+    float *amp = B->amp + (size_t)B->maxlevels*v;
+    // Same order of operations as lattice_build
+    float a = 1.0f;
+    B->max[v] = 0.0f;
+    for (l = 0; l < B->levels[v]; l++) {
+      amp[l] = a;
+      B->max[v] += a;
+      a *= persistences[v];
+    }
+    for (w = 0; w < v && bases[w] != bases[v]; w++)
+      ;
+    if (w < v) {
+      B->lattice[v] = B->lattice[w];
+      continue;
+    }
+    // The lattice for the variant of this base with the most octaves
+    perlin_params q = *p;
+    int most = v;
+    for (w = v + 1; w < n; w++)
+      if (bases[w] == bases[v] && B->levels[w] > B->levels[most])
+        most = w;
+    q.base = bases[v];
+    q.persistence = persistences[most];
+    if (grid_setup(__x, __y, __z, &q, threads, &B->L[B->nlattices]) < 0) {
+      batch_free(B);
+      return -1;
+    }
+    B->lattice[v] = B->nlattices++;
+  }
+  return 0;
+nomem:
+  batch_free(B);
+  PyErr_NoMemory();
+  return -1;
+}
+
+static PyObject *
+make_perlin_batch(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	perlin_params p;
+	perlin_batch B;
+	int threads = 0, n, *bases;
+	float *persistences;
+	const char *layout_name = "zyx";
+	int layout;
+  PyObject *__x, *__y, *__z, *__bases, *__persistences;
+  PyObject *out = Py_None, *filters = Py_None, *norm = Py_None;
+  perlin_output o;
+	default_params(&p);
+
+	static char *kwlist[] = {"x", "y", "z", "bases", "persistences", "octaves", "lacunarity",
+		"repeatx", "repeaty", "repeatz", "threads", "layout", "out", "filters", "norm", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOOOO|ifiiiisOOO:make_perlin_batch", kwlist,
+		&__x, &__y, &__z, &__bases, &__persistences, &p.octaves, &p.lacunarity, &p.repeatx, &p.repeaty, &p.repeatz,
+		&threads, &layout_name, &out, &filters, &norm))
+		return NULL;
+  if (strcmp(layout_name, "xyz") == 0)
+    layout = LAYOUT_XYZ;
+  else if (strcmp(layout_name, "zyx") == 0)
+    layout = LAYOUT_ZYX;
+  else {
+    PyErr_SetString(PyExc_ValueError, "Layout must be 'xyz' or 'zyx'");
+    return NULL;
+  }
+  n = batch_variants(__bases, __persistences, &bases, &persistences);
+  if (n < 0)
+    return NULL;
+  const int err_setup = batch_setup(__x, __y, __z, &p, bases, persistences, n, threads, &B);
+  free(bases);
+  free(persistences);
+  if (err_setup < 0)
+    return NULL;
+  const int len_x = B.L[0].len_x, len_y = B.L[0].len_y, len_z = B.L[0].len_z;
+  npy_intp dims[4] = { n, len_x, len_y, len_z };
+  if (layout == LAYOUT_ZYX) {
+    dims[1] = len_z;
+    dims[3] = len_x;
+  }
+  int out_type = NPY_FLOAT;
+  void *ret;
+  if (out != Py_None)
+    out_type = check_out(out, 4, dims);
+  if (out_type < 0 || parse_grid_output(filters, norm, out_type, &o) < 0) {
+    batch_free(&B);
+    return NULL;
+  }
+  if (out != Py_None)
+    ret = PyArray_DATA((PyArrayObject*)out);
+  else {
+    const double size = (double)n*len_x*len_y*len_z;
+    ret = size*sizeof(float) > (double)SIZE_MAX ? NULL : malloc(sizeof(float)*(size_t)size);
+    if (!ret) {
+      batch_free(&B);
+      return PyErr_NoMemory();
+    }
+  }
+
+  int err;
+  const double t0 = wall_seconds();
+  Py_BEGIN_ALLOW_THREADS
+  err = perlin_grid_batch(&B, layout, 0, len_z, ret, &o, threads);
+  Py_END_ALLOW_THREADS
+  counters.grid_calls++;
+  counters.grid_samples += (unsigned long long)n*len_x*len_y*len_z;
+  counters.grid_seconds += wall_seconds() - t0;
+  batch_free(&B);
+  if (err < 0) {
+    if (out == Py_None)
+      free(ret);
+    return PyErr_NoMemory();
+  }
+
+  if (out != Py_None) {
+    Py_INCREF(out);
+    return out;
+  }
+  PyObject *retarray = PyArray_SimpleNewFromData(4, dims, NPY_FLOAT, ret);
+  if (!retarray) {
+    free(ret);
+    return NULL;
+  }
+  PyArray_ENABLEFLAGS((PyArrayObject*)retarray, NPY_ARRAY_OWNDATA);
+  return retarray;
+}
+
+// noise3 at scattered points, rather than on a grid
+static PyObject *
+py_noise3(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+  PyObject *__x, *__y, *__z;
+  int repeatx = 1024, repeaty = 1024, repeatz = 1024, base = 0, threads = 0;
+	static char *kwlist[] = {"x", "y", "z", "repeatx", "repeaty", "repeatz", "base", "threads", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOO|iiiii:noise3", kwlist,
+    &__x, &__y, &__z, &repeatx, &repeaty, &repeatz, &base, &threads))
+		return NULL;
+  if (repeatx <= 0 || repeaty <= 0 || repeatz <= 0) {
+    PyErr_SetString(PyExc_ValueError, "Expected repeat values > 0");
+    return NULL;
+  }
+  if (threads < 0) {
+    PyErr_SetString(PyExc_ValueError, "Expected threads value >= 0");
+    return NULL;
+  }
+  PyArrayObject *x = (PyArrayObject*)PyArray_FROMANY(__x, NPY_FLOAT, 0, 0, NPY_ARRAY_C_CONTIGUOUS);
+  PyArrayObject *y = (PyArrayObject*)PyArray_FROMANY(__y, NPY_FLOAT, 0, 0, NPY_ARRAY_C_CONTIGUOUS);
+  PyArrayObject *z = (PyArrayObject*)PyArray_FROMANY(__z, NPY_FLOAT, 0, 0, NPY_ARRAY_C_CONTIGUOUS);
+  PyObject *ret = NULL;
+  if (!x || !y || !z)
+    goto done;
+  const npy_intp n = PyArray_SIZE(x);
+  if (PyArray_SIZE(y) != n || PyArray_SIZE(z) != n) {
+    PyErr_SetString(PyExc_ValueError, "x, y and z must be the same size");
+    goto done;
+  }
+  ret = PyArray_SimpleNew(PyArray_NDIM(x), PyArray_DIMS(x), NPY_FLOAT);
+  if (!ret)
+    goto done;
+  const float *xs = (const float*)PyArray_DATA(x), *ys = (const float*)PyArray_DATA(y), *zs = (const float*)PyArray_DATA(z);
+  float *out = (float*)PyArray_DATA((PyArrayObject*)ret);
+  npy_intp m;
+  Py_BEGIN_ALLOW_THREADS
+#ifdef _OPENMP
+  if (threads <= 0)
+    threads = omp_get_max_threads();
+#pragma omp parallel for schedule(static) num_threads(threads)
+#endif
+  for (m = 0; m < n; m++)
+    out[m] = noise3(xs[m], ys[m], zs[m], repeatx, repeaty, repeatz, base);
+  Py_END_ALLOW_THREADS
+done:
+  Py_XDECREF(x);
+  Py_XDECREF(y);
+  Py_XDECREF(z);
+  return ret;
+}
+
+// Gaussian blur of each frame, in place
+static PyObject *
+py_blur(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+  PyObject *__arr;
+  PyArrayObject *arr;
+  float sigma;
+  int threads = 0, t, err = 0;
+	static char *kwlist[] = {"arr", "sigma", "threads", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Of|i:blur", kwlist, &__arr, &sigma, &threads))
+		return NULL;
+  if (threads < 0) {
+    PyErr_SetString(PyExc_ValueError, "Expected threads value >= 0");
+    return NULL;
+  }
+  if (!(sigma >= 0)) {
+    PyErr_SetString(PyExc_ValueError, "Blur sigma must be >= 0");
+    return NULL;
+  }
+  arr = (PyArrayObject*)__arr;
+  if (!PyArray_Check(__arr) || PyArray_TYPE(arr) != NPY_FLOAT || !PyArray_ISCARRAY(arr) || PyArray_NDIM(arr) < 2) {
+    PyErr_SetString(PyExc_ValueError, "arr must be a writable C-contiguous float32 array with at least 2 dimensions");
+    return NULL;
+  }
+  const int ndim = PyArray_NDIM(arr);
+  const npy_intp ny = PyArray_DIM(arr, ndim-2), nx = PyArray_DIM(arr, ndim-1);
+  if (ny > INT_MAX || nx > INT_MAX) {
+    PyErr_SetString(PyExc_ValueError, "Frames are too large");
+    return NULL;
+  }
+  const npy_intp fsize = ny*nx, nframes = fsize ? PyArray_SIZE(arr) / fsize : 0;
+  const int radius = gaussian_radius(sigma);
+  float *data = (float*)PyArray_DATA(arr);
+  blur_scratch *scratch;
+  npy_intp c;
+#ifdef _OPENMP
+  if (threads <= 0)
+    threads = omp_get_max_threads();
+#else
+  threads = 1;
+#endif
+  if (nframes < threads)
+    threads = nframes > 0 ? (int)nframes : 1;
+  scratch = (blur_scratch*)calloc(threads, sizeof(blur_scratch));
+  for (t = 0; scratch && t < threads && !err; t++)
+    err = blur_scratch_alloc(&scratch[t], (int)ny, (int)nx, radius);
+  if (!scratch || err) {
+    for (t = 0; scratch && t < threads; t++)
+      blur_scratch_free(&scratch[t]);
+    free(scratch);
+    return PyErr_NoMemory();
+  }
+  Py_BEGIN_ALLOW_THREADS
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+#endif
+  for (c = 0; c < nframes; c++) {
+#ifdef _OPENMP
+    const int th = omp_get_thread_num();
+#else
+    const int th = 0;
+#endif
+    blur_frame(data + (size_t)(c*fsize), (int)ny, (int)nx, sigma, &scratch[th]);
+  }
+  Py_END_ALLOW_THREADS
+  for (t = 0; t < threads; t++)
+    blur_scratch_free(&scratch[t]);
+  free(scratch);
+  Py_INCREF(__arr);
+  return __arr;
+}
+
+static PyObject *
+get_counters(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+  int reset = 0;
+	static char *kwlist[] = {"reset", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|p:counters", kwlist, &reset))
+		return NULL;
+  PyObject *ret = Py_BuildValue("{s:K,s:K,s:d,s:K,s:K,s:d}",
+    "grid_calls", counters.grid_calls, "grid_samples", counters.grid_samples,
+    "grid_seconds", counters.grid_seconds,
+    "postprocess_calls", counters.postprocess_calls, "postprocess_samples", counters.postprocess_samples,
+    "postprocess_seconds", counters.postprocess_seconds);
+  if (ret && reset)
+    memset(&counters, 0, sizeof(counters));
+  return ret;
+}
+
+static PyObject *
+set_simd(PyObject *self, PyObject *args)
+{
+  const char *name;
+  if (!PyArg_ParseTuple(args, "s:set_simd", &name))
+    return NULL;
+  PyObject *prev = PyUnicode_FromString(perlin_simd);
+  if (!prev)
+    return NULL;
+  if (set_kernel(name) < 0) {
+    Py_DECREF(prev);
+    PyErr_Format(PyExc_ValueError, "SIMD level '%s' is not available", name);
+    return NULL;
+  }
+  return prev;
+}
+
+// The coarse octaves of a PerlinStream, evaluated incrementally.  Within one
+// lattice cell along z, noise3 at a fixed (x,y) is linear in z apart from
+// the final fade between the cell's two ends, i.e.
+//   v = P + fz*(Q - P),  P = P0 + P1*z,  Q = Q0 + Q1*(z - 1)
+// The four coefficients of each pixel only depend on the cell, so they are
+// computed once per cell and reused for every frame in it.  The result is
+// the same polynomial as the full evaluation, but rounded differently, so
+// it is not bit-for-bit identical.
+typedef struct {
+  int levels;             // Octaves 0 to levels-1 are cached
+  float *coef;            // (levels, 4, len_y, len_x) of P0, P1, Q0, Q1
+  int *cell_lo, *cell_hi; // The z cell of each level's coefficients
+  PyThread_type_lock lock; // Held while the coefficients are in use
+} coarse_cache;
+
+static void
+coarse_free(coarse_cache *c)
+{
+  free(c->coef);
+  free(c->cell_lo);
+  free(c->cell_hi);
+  if (c->lock)
+    PyThread_free_lock(c->lock);
+  memset(c, 0, sizeof(*c));
+}
+
+// Set up the cache for the octaves whose z cells span at least min_frames
+// frames.  Returns -1 if out of memory.
+static int
+coarse_setup(coarse_cache *c, const perlin_lattice *L, const float *z, const perlin_params *p,
+  const float min_frames)
+{
+  const double dz = L->len_z > 1 ? (double)z[1] - z[0] : 0;
+  double freq = 1;
+  int l;
+  memset(c, 0, sizeof(*c));
+  for (l = 0; l < L->levels && min_frames > 0 && dz > 0; l++) {
+    if (1/(freq*dz) < min_frames)
+      break;
+    c->levels++;
+    freq *= p->lacunarity;
+  }
+  if (!c->levels)
+    return 0;
+  c->coef = (float*)malloc(sizeof(float)*4*(size_t)c->levels*L->len_y*L->len_x);
+  c->cell_lo = (int*)malloc(sizeof(int)*c->levels);
+  c->cell_hi = (int*)malloc(sizeof(int)*c->levels);
+  c->lock = PyThread_allocate_lock();
+  if (!c->coef || !c->cell_lo || !c->cell_hi || !c->lock) {
+    coarse_free(c);
+    return -1;
+  }
+  for (l = 0; l < c->levels; l++)
+    c->cell_lo[l] = c->cell_hi[l] = -1;
+  return 0;
+}
+
+static inline float
+grad2(const int hash, const float x, const float y)
+{
+	const int h = hash & 15;
+	return x * GRAD3[h][0] + y * GRAD3[h][1];
+}
+
+// The blend of the z components of the gradients at the corners of a cell
+static inline float
+gradz_corners(const int AA, const int AB, const int BA, const int BB, const int k,
+	const float fx, const float fy)
+{
+	return lerp(fy, lerp(fx, GRAD3[PERM[AA + k] & 15][2], GRAD3[PERM[BA + k] & 15][2]),
+					lerp(fx, GRAD3[PERM[AB + k] & 15][2], GRAD3[PERM[BB + k] & 15][2]));
+}
+
+// Likewise for the x and y components
+static inline float
+gradxy_corners(const int AA, const int AB, const int BA, const int BB, const int k,
+	const float x, const float y, const float fx, const float fy)
+{
+	return lerp(fy, lerp(fx, grad2(PERM[AA + k], x, y), grad2(PERM[BA + k], x - 1, y)),
+					lerp(fx, grad2(PERM[AB + k], x, y - 1), grad2(PERM[BB + k], x - 1, y - 1)));
+}
+
+// Compute the coefficients of octave l for the z cell of frame k
+static void
+coarse_plane(const perlin_lattice *L, coarse_cache *c, const int l, const int k, const int threads)
+{
+	const lattice_axis *X = &L->x[l], *Y = &L->y[l], *Z = &L->z[l];
+	const int len_x = L->len_x, len_y = L->len_y;
+	const int k0 = Z->lo[k], k1 = Z->hi[k];
+	const size_t plane = (size_t)len_y*len_x;
+	float *coef = c->coef + 4*plane*l;
+	int j;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) num_threads(threads)
+#endif
+	for (j = 0; j < len_y; j++) {
+		const int j0 = Y->lo[j], j1 = Y->hi[j];
+		const float y = Y->t[j], fy = Y->f[j];
+		float *row = coef + (size_t)j*len_x;
+		int i;
+		for (i = 0; i < len_x; i++) {
+			const int A = X->lo[i], B = X->hi[i];
+			const int AA = PERM[A + j0], AB = PERM[A + j1], BA = PERM[B + j0], BB = PERM[B + j1];
+			row[i] = gradxy_corners(AA, AB, BA, BB, k0, X->t[i], y, X->f[i], fy);
+			row[plane + i] = gradz_corners(AA, AB, BA, BB, k0, X->f[i], fy);
+			row[2*plane + i] = gradxy_corners(AA, AB, BA, BB, k1, X->t[i], y, X->f[i], fy);
+			row[3*plane + i] = gradz_corners(AA, AB, BA, BB, k1, X->f[i], fy);
+		}
+	}
+	c->cell_lo[l] = k0;
+	c->cell_hi[l] = k1;
+}
+
+// perlin_grid for LAYOUT_ZYX, with the octaves in c evaluated from their
+// coefficients and the rest by the row kernel.  The caller must hold c's
+// lock.  Returns -1 if out of memory.
+static int
+perlin_grid_coarse(const perlin_lattice *L, coarse_cache *c, const int z0, const int z1,
+	void *ret, const perlin_output *o, int threads)
+{
+	const int len_x = L->len_x, len_y = L->len_y;
+	const size_t elsize = output_elsize(o);
+	perlin_lattice fine = *L;
+	float *scratch = NULL;
+	int k, l;
+#ifdef _OPENMP
+	if (threads <= 0)
+		threads = omp_get_max_threads();
+#else
+	threads = 1;
+#endif
+	// The remaining octaves, summed without normalising
+	fine.x += c->levels;
+	fine.y += c->levels;
+	fine.z += c->levels;
+	fine.amp += c->levels;
+	fine.levels -= c->levels;
+	fine.single = 0;
+	fine.max = 1.0f;
+	if (!output_is_raw(o)) {
+		scratch = (float*)malloc(sizeof(float)*(size_t)len_x*threads);
+		if (!scratch)
+			return -1;
+	}
+	for (k = z0; k < z1; k++) {
+		int j;
+		for (l = 0; l < c->levels; l++)
+			if (c->cell_lo[l] != L->z[l].lo[k] || c->cell_hi[l] != L->z[l].hi[k])
+				coarse_plane(L, c, l, k, threads);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) num_threads(threads)
+#endif
+		for (j = 0; j < len_y; j++) {
+			char *dest = (char*)ret + elsize*((size_t)(k - z0)*len_y + j)*len_x;
+			float *row = (float*)dest;
+			int i, m;
+			if (scratch) {
+#ifdef _OPENMP
+				row = scratch + (size_t)len_x*omp_get_thread_num();
+#else
+				row = scratch;
+#endif
+			}
+			if (fine.levels > 0)
+				perlin_row(&fine, LAYOUT_ZYX, k, j, 0, len_x, row);
+			else
+				for (i = 0; i < len_x; i++)
+					row[i] = 0.0f;
+			for (m = 0; m < c->levels; m++) {
+				const size_t plane = (size_t)len_y*len_x;
+				const float *P0 = c->coef + 4*plane*m + (size_t)j*len_x;
+				const float *P1 = P0 + plane, *Q0 = P1 + plane, *Q1 = Q0 + plane;
+				const float z = L->z[m].t[k], fz = L->z[m].f[k], amp = L->amp[m];
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+				for (i = 0; i < len_x; i++) {
+					const float P = P0[i] + P1[i] * z;
+					const float Q = Q0[i] + Q1[i] * (z - 1);
+					row[i] += lerp(fz, P, Q) * amp;
+				}
+			}
+			if (!L->single)
+				for (i = 0; i < len_x; i++)
+					row[i] = (float) (row[i] / L->max);
+			if (scratch)
+				postprocess_row(o, row, len_x, dest);
+		}
+	}
+	free(scratch);
+	return 0;
+}
+
+// A grid whose lattice tables are kept between calls, from which frames
+// (z indices) can be generated in any order.
+typedef struct {
+  PyObject_HEAD
+  perlin_lattice L;
+  coarse_cache coarse;
+  int threads;
+  int next; // Frame returned by the next call to __next__
+} PerlinStream;
+
+static int
+PerlinStream_init(PerlinStream *self, PyObject *args, PyObject *kwargs)
+{
+	perlin_params p;
+	int threads = 0;
+	float coarse_frames = 0;
+	const char *precision = "float32";
+  PyObject *__x, *__y, *__z;
+  PyArrayObject *z;
+	default_params(&p);
+
+	static char *kwlist[] = {"x", "y", "z", "octaves", "persistence", "lacunarity",
+		"repeatx", "repeaty", "repeatz", "base", "threads", "coarse_frames", "precision", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOO|iffiiiiifs:PerlinStream", kwlist,
+		&__x, &__y, &__z, &p.octaves, &p.persistence, &p.lacunarity, &p.repeatx, &p.repeaty, &p.repeatz, &p.base, &threads,
+		&coarse_frames, &precision))
+		return -1;
+  if (parse_precision(precision, &p) < 0)
+    return -1;
+  if (p.fixed && coarse_frames > 0) {
+    PyErr_SetString(PyExc_ValueError, "coarse_frames is not supported with fixed16 precision");
+    return -1;
+  }
+  lattice_free(&self->L);
+  coarse_free(&self->coarse);
+  if (grid_setup(__x, __y, __z, &p, threads, &self->L) < 0)
+    return -1;
+  z = (PyArrayObject*)PyArray_FROMANY(__z, NPY_FLOAT, 1, 1, NPY_ARRAY_C_CONTIGUOUS);
+  if (!z)
+    return -1;
+  const int err = coarse_setup(&self->coarse, &self->L, (const float*)PyArray_DATA(z), &p, coarse_frames);
+  Py_DECREF(z);
+  if (err < 0) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  self->threads = threads;
+  self->next = 0;
+  return 0;
+}
+
+static void
+PerlinStream_dealloc(PerlinStream *self)
+{
+  lattice_free(&self->L);
+  coarse_free(&self->coarse);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+// Generate frames start to stop-1 into out, which is allocated if NULL,
+// post-processed according to filters and norm as for make_perlin.
+static PyObject *
+stream_frames(PerlinStream *self, const int start, const int stop, PyObject *out,
+  PyObject *filters, PyObject *norm)
+{
+  perlin_output o;
+  const perlin_lattice *L = &self->L;
+  npy_intp dims[3] = { stop - start, L->len_y, L->len_x };
+  if (!L->mem) {
+    PyErr_SetString(PyExc_RuntimeError, "PerlinStream is not initialised");
+    return NULL;
+  }
+  if (start < 0 || stop > L->len_z || start >= stop) {
+    PyErr_SetString(PyExc_IndexError, "Frame range out of bounds");
+    return NULL;
+  }
+  int out_type = NPY_FLOAT;
+  if (out)
+    out_type = check_out(out, 3, dims);
+  if (out_type < 0 || parse_grid_output(filters, norm, out_type, &o) < 0)
+    return NULL;
+  if (out) {
+    Py_INCREF(out);
+  } else {
+    out = PyArray_SimpleNew(3, dims, NPY_FLOAT);
+    if (!out)
+      return NULL;
+  }
+  void *ret = PyArray_DATA((PyArrayObject*)out);
+  int err;
+  const double t0 = wall_seconds();
+  Py_BEGIN_ALLOW_THREADS
+  if (self->coarse.levels) {
+    // The coefficients are shared by every call, so calls from several
+    // threads take turns
+    PyThread_acquire_lock(self->coarse.lock, WAIT_LOCK);
+    err = perlin_grid_coarse(L, &self->coarse, start, stop, ret, &o, self->threads);
+    PyThread_release_lock(self->coarse.lock);
+  } else
+    err = perlin_grid(L, LAYOUT_ZYX, start, stop, ret, &o, self->threads);
+  Py_END_ALLOW_THREADS
+  counters.grid_calls++;
+  counters.grid_samples += (unsigned long long)(stop - start)*L->len_y*L->len_x;
+  counters.grid_seconds += wall_seconds() - t0;
+  if (err < 0) {
+    Py_DECREF(out);
+    return PyErr_NoMemory();
+  }
+  return out;
+}
+
+static PyObject *
+PerlinStream_frames(PerlinStream *self, PyObject *args, PyObject *kwargs)
+{
+  int start;
+  PyObject *stop = Py_None;
+  PyObject *out = Py_None, *filters = Py_None, *norm = Py_None;
+	static char *kwlist[] = {"start", "stop", "out", "filters", "norm", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|OOOO:frames", kwlist, &start, &stop, &out, &filters, &norm))
+		return NULL;
+  // Parsed like start with "i", so that no value wraps round into range
+  long long stop_ = (long long)start + 1;
+  if (stop != Py_None) {
+    int overflow;
+    stop_ = PyLong_AsLongLongAndOverflow(stop, &overflow);
+    if (stop_ == -1 && PyErr_Occurred())
+      return NULL;
+    if (overflow || stop_ > INT_MAX || stop_ < INT_MIN) {
+      PyErr_SetString(PyExc_OverflowError, "stop does not fit in a C int");
+      return NULL;
+    }
+  }
+  if (stop_ > INT_MAX) {
+    PyErr_SetString(PyExc_IndexError, "Frame range out of bounds");
+    return NULL;
+  }
+  return stream_frames(self, start, (int)stop_, out == Py_None ? NULL : out, filters, norm);
+}
+
+static PyObject *
+PerlinStream_iternext(PerlinStream *self)
+{
+  if (!self->L.mem || self->next >= self->L.len_z)
+    return NULL;
+  PyObject *frames = stream_frames(self, self->next, self->next + 1, NULL, NULL, NULL);
+  if (!frames)
+    return NULL;
+  self->next++;
+  npy_intp dims[2] = { self->L.len_y, self->L.len_x };
+  PyArray_Dims shape = { dims, 2 };
+  PyObject *frame = PyArray_Newshape((PyArrayObject*)frames, &shape, NPY_CORDER);
+  Py_DECREF(frames);
+  return frame;
+}
+
+static PyObject *
+PerlinStream_seek(PerlinStream *self, PyObject *args)
+{
+  int t;
+	if (!PyArg_ParseTuple(args, "i:seek", &t))
+		return NULL;
+  if (t < 0 || t > self->L.len_z) {
+    PyErr_SetString(PyExc_IndexError, "Frame out of bounds");
+    return NULL;
+  }
+  self->next = t;
+  Py_RETURN_NONE;
+}
+
+static Py_ssize_t
+PerlinStream_len(PerlinStream *self)
+{
+  return self->L.len_z;
+}
+
+static PyObject *
+PerlinStream_shape(PerlinStream *self, void *closure)
+{
+  return Py_BuildValue("(iii)", self->L.len_z, self->L.len_y, self->L.len_x);
+}
+
+static PyMethodDef PerlinStream_methods[] = {
+	{"frames", (PyCFunction) PerlinStream_frames, METH_VARARGS | METH_KEYWORDS,
+    "Generate a range of frames\n\
+\n\
+    Parameters\n\
+    ----------\n\
+    start : int\n\
+        Index into z of the first frame\n\
+    stop : int, optional\n\
+        Index one past the last frame, by default start+1\n\
+    out : 3D ndarray of float32, uint8 or int16, optional\n\
+        Writable C-contiguous array of shape (stop-start, len(y), len(x))\n\
+        to fill instead of allocating a new one, as for make_perlin\n\
+    filters, norm : optional\n\
+        Post-processing applied as the frames are generated, as for\n\
+        make_perlin\n\
+\n\
+    Returns\n\
+    -------\n\
+    3D float32 ndarray, values ∈ [-1,1]\n\
+        The frames, of shape (stop-start, len(y), len(x)), or out\n\
+"},
+	{"seek", (PyCFunction) PerlinStream_seek, METH_VARARGS,
+    "Set the index of the next frame returned when iterating"},
+	{NULL}
+};
+
+static PyGetSetDef PerlinStream_getset[] = {
+  {"shape", (getter) PerlinStream_shape, NULL, "Shape (len(z), len(y), len(x)) of the full movie", NULL},
+  {NULL}
+};
+
+static PySequenceMethods PerlinStream_as_sequence = {
+  .sq_length = (lenfunc) PerlinStream_len,
+};
+
+static PyTypeObject PerlinStreamType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "zebranoise._perlin.PerlinStream",
+  .tp_basicsize = sizeof(PerlinStream),
+  .tp_dealloc = (destructor) PerlinStream_dealloc,
+  .tp_as_sequence = &PerlinStream_as_sequence,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "Perlin noise movie generated frame by frame\n\
+\n\
+    PerlinStream(x, y, z, octaves=1, persistence=0.5, lacunarity=2.0,\n\
+                 repeatx=1024, repeaty=1024, repeatz=1024, base=0, threads=0,\n\
+                 coarse_frames=0, precision='float32')\n\
+\n\
+    Takes the same arguments as make_perlin, where z is the time axis of\n\
+    the whole movie.  The lattice for the grid is computed once, and frames\n\
+    are then generated on demand with frames(), or by iterating, as\n\
+    contiguous (len(y), len(x)) float32 arrays.  The output is identical to\n\
+    make_perlin's.\n\
+\n\
+    If coarse_frames > 0, the octaves whose lattice cells span at least\n\
+    that many frames are computed incrementally: four coefficients per\n\
+    pixel are kept for the current cell, from which each frame in it is\n\
+    found with a few multiply-adds.  This is exact up to float rounding,\n\
+    and is fastest when frames are generated in order.  It takes\n\
+    16*len(y)*len(x) bytes per octave, and calls to frames() from several\n\
+    threads wait for each other.  It cannot be combined with fixed16\n\
+    precision.\n\
+",
+  .tp_iter = PyObject_SelfIter,
+  .tp_iternext = (iternextfunc) PerlinStream_iternext,
+  .tp_methods = PerlinStream_methods,
+  .tp_getset = PerlinStream_getset,
+  .tp_init = (initproc) PerlinStream_init,
+  .tp_new = PyType_GenericNew,
+};
+
+static PyMethodDef perlin_functions[] = {
+	{"make_perlin", (PyCFunction) make_perlin, METH_VARARGS | METH_KEYWORDS,
+    "Generate a perlin noise stimulus\n\
+\n\
+    Parameters\n\
+    ----------\n\
+    x,y,z : 1D ndarray of float32, length > 0\n\
+        Grid of positions on which to compute the noise\n\
+    octaves : int > 0, default: 1\n\
+        Number of spatial scales to include\n\
+    persistence : float > 0, default: 0.5\n\
+        Relative strength of neighbouring octaves\n\
+    repeatx,repeaty,repeatz : int > 0, default: 1024\n\
+        Maximum x, y, or z value before the stimulus repeats\n\
+    base : int ∈ [0,255], default: 0\n\
+        Start position of the permutation, essentially the random seed\n\
+    threads : int >= 0, default: 0\n\
+        Number of worker threads, or 0 to use all available cores.  The\n\
+        GIL is released while the noise is computed.\n\
+    layout : {'xyz', 'zyx'}, default: 'xyz'\n\
+        Axis order of the output.  With 'zyx' each z value is one\n\
+        contiguous (y,x) frame.\n\
+    out : 3D ndarray of float32, uint8 or int16, optional\n\
+        Writable C-contiguous array of the output shape to fill in place\n\
+        instead of allocating a new one.  For uint8, noise values v are\n\
+        stored as floor((v+1)/2*255), clipped to [0,255], unless filters\n\
+        (other than an empty list) or norm are given.  For int16, they are stored as round(v*8192),\n\
+        without filters or norm.\n\
+    filters : list of str and/or (str, float) tuples, optional\n\
+        Per-pixel filters to apply as the noise is generated, in the same\n\
+        format as PerlinStimulus.save_video.  Only threshold, softthresh,\n\
+        comb, invert, wood, center and reverse (ignored) are supported.\n\
+        For uint8 output the result is then discretized, so this is\n\
+        equivalent to discretize(apply_filters(noise, filters)).\n\
+    norm : (float, float), optional\n\
+        (min, max) of the noise, mapped onto [0,1] before filtering\n\
+    precision : {'float32', 'fixed16'}, default: 'float32'\n\
+        The arithmetic of the kernel.  'fixed16' computes in 16-bit fixed\n\
+        point, twice as many samples per SIMD instruction, and differs\n\
+        from 'float32' by at most (6 + octaves/2)/8192, i.e. well under\n\
+        one grey level of uint8 output.  It writes int16 output directly.\n\
+\n\
+    Returns\n\
+    -------\n\
+    3D float32 ndarray, values ∈ [-1,1]\n\
+        Pink noise movie, of shape (x,y,z) or (z,y,x) depending on layout,\n\
+        or out if given\n\
+"},
+	{"make_perlin_batch", (PyCFunction) make_perlin_batch, METH_VARARGS | METH_KEYWORDS,
+    "Generate several variants of a perlin noise stimulus in one pass\n\
+\n\
+    The variants share the grid and all other parameters of make_perlin,\n\
+    and each is identical to the output of make_perlin.  Variants with the\n\
+    same base but different persistences share the evaluation of each\n\
+    octave, so they cost little more than one of them.  Variants with\n\
+    different bases share nothing, and take as long as calling\n\
+    make_perlin for each of them.\n\
+\n\
+    Parameters\n\
+    ----------\n\
+    x,y,z : 1D ndarray of float32, length > 0\n\
+        Grid of positions on which to compute the noise\n\
+    bases : sequence of int ∈ [0,255]\n\
+        The base of each variant\n\
+    persistences : sequence of float > 0\n\
+        The persistence of each variant.  Either this or bases may have\n\
+        length 1, to use the same value for every variant.\n\
+    layout : {'xyz', 'zyx'}, default: 'zyx'\n\
+        Axis order of each variant's output\n\
+    out : 4D ndarray of float32 or uint8, optional\n\
+        Writable C-contiguous array of the output shape to fill in place\n\
+\n\
+    The other parameters are as for make_perlin.\n\
+\n\
+    Returns\n\
+    -------\n\
+    4D float32 ndarray, values ∈ [-1,1]\n\
+        The variants, of shape (variants, z, y, x) or (variants, x, y, z)\n\
+        depending on layout, or out if given\n\
+"},
+	{"postprocess", (PyCFunction) postprocess, METH_VARARGS | METH_KEYWORDS,
+    "Normalise, filter and discretize noise in a single pass\n\
+\n\
+    Parameters\n\
+    ----------\n\
+    arr : ndarray of float16, float32, uint8 or uint16\n\
+        Noise to process, e.g. frames read from the cache.  Integer\n\
+        values are taken as they are, so pass norm to rescale them.\n\
+    filters, norm : optional\n\
+        Post-processing to apply, as for make_perlin.  Unlike make_perlin,\n\
+        this also supports blur, applied to each frame over the last two\n\
+        dimensions of arr, as for the blur function.\n\
+    out : ndarray of uint8 or float32, optional\n\
+        Writable C-contiguous array of the same shape as arr to fill\n\
+    threads : int >= 0, default: 0\n\
+        Number of worker threads, or 0 to use all available cores\n\
+    mean : ndarray of float32, optional\n\
+        Subtracted from arr first, broadcast over its leading dimensions\n\
+\n\
+    Returns\n\
+    -------\n\
+    ndarray of uint8, or out if given\n\
+        The processed noise, equivalent to\n\
+        discretize(apply_filters((arr-min)/(max-min), filters))\n\
+"},
+	{"noise3", (PyCFunction) py_noise3, METH_VARARGS | METH_KEYWORDS,
+    "Evaluate single-octave Perlin noise at scattered points\n\
+\n\
+    Parameters\n\
+    ----------\n\
+    x,y,z : ndarray of float32, all the same size\n\
+        Coordinates of the points\n\
+    repeatx,repeaty,repeatz : int > 0, default: 1024\n\
+        Period of the noise in each dimension\n\
+    base : int ∈ [0,255], default: 0\n\
+        Start position of the permutation, essentially the random seed\n\
+    threads : int >= 0, default: 0\n\
+        Number of worker threads, or 0 to use all available cores\n\
+\n\
+    Returns\n\
+    -------\n\
+    ndarray of float32\n\
+        The noise at each point, with the shape of x\n\
+"},
+	{"blur", (PyCFunction) py_blur, METH_VARARGS | METH_KEYWORDS,
+    "Gaussian blur each frame in place, with periodic boundaries\n\
+\n\
+    Equivalent to scipy.ndimage.gaussian_filter(frame, sigma, mode='wrap')\n\
+    for each frame, up to rounding of the kernel weights.\n\
+\n\
+    Parameters\n\
+    ----------\n\
+    arr : ndarray of float32\n\
+        Writable C-contiguous array whose last two dimensions are (y,x)\n\
+    sigma : float >= 0\n\
+        Standard deviation of the Gaussian, in pixels\n\
+    threads : int >= 0, default: 0\n\
+        Number of worker threads, or 0 to use all available cores.  Each\n\
+        thread blurs whole frames.\n\
+\n\
+    Returns\n\
+    -------\n\
+    arr\n\
+"},
+	{"counters", (PyCFunction) get_counters, METH_VARARGS | METH_KEYWORDS,
+    "Return the totals of the always-on profiling counters\n\
+\n\
+    Parameters\n\
+    ----------\n\
+    reset : bool, default: False\n\
+        Set the counters to zero after reading them\n\
+\n\
+    Returns\n\
+    -------\n\
+    dict\n\
+        The number of calls, samples and seconds of wall-clock time spent\n\
+        generating grids (make_perlin and PerlinStream.frames) and in\n\
+        postprocess\n\
+"},
+	{"set_simd", (PyCFunction) set_simd, METH_VARARGS,
+    "Choose the instruction set used to generate noise grids\n\
+\n\
+    Parameters\n\
+    ----------\n\
+    name : {'auto', 'scalar', 'avx2', 'avx512'}\n\
+        The kernel to use.  'auto' picks the best one for this CPU, which\n\
+        is also the default and is given by the SIMD constant.  All of\n\
+        them give identical output.\n\
+\n\
+    Returns\n\
+    -------\n\
+    str\n\
+        The name of the kernel used previously\n\
+"},
+	{NULL}
+};
+
+PyDoc_STRVAR(module_doc, "Efficiently generate Perlin noise, based on the 'noise' package by Casey Duncan");
+
+static struct PyModuleDef moduledef = {
+	PyModuleDef_HEAD_INIT,
+	"_perlin",
+	module_doc,
+	-1,                 /* m_size */
+	perlin_functions,   /* m_methods */
+	NULL,               /* m_reload (unused) */
+	NULL,               /* m_traverse */
+	NULL,               /* m_clear */
+	NULL                /* m_free */
+};
+
+PyObject *
+PyInit__perlin(void)
+{
+  PyObject *m;
+  import_array();
+  init_tables();
+  select_kernel();
+  if (PyType_Ready(&PerlinStreamType) < 0)
+    return NULL;
+  m = PyModule_Create(&moduledef);
+  if (!m)
+    return NULL;
+  Py_INCREF(&PerlinStreamType);
+  if (PyModule_AddObject(m, "PerlinStream", (PyObject*)&PerlinStreamType) < 0
+      || PyModule_AddStringConstant(m, "SIMD", perlin_simd) < 0
+      || PyModule_AddObject(m, "PERM", PyBytes_FromStringAndSize((const char*)PERM, sizeof(PERM))) < 0) {
+    Py_DECREF(m);
+    return NULL;
+  }
+  return m;
 }
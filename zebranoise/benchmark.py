@@ -0,0 +1,347 @@
+"""Throughput benchmarks for the noise kernel and the video pipelines.
+
+Run with
+
+    python -m zebranoise.benchmark [-o results.json] [--quick]
+
+to print the results as JSON, or with --check to only check that the
+kernels give identical output, see check().  Each result gives the best wall-clock time of
+several repeats, and from it ns/sample, frames/s and GB/s of output.  The
+kernel benchmarks are repeated for each thread count and each SIMD level
+supported by the CPU, so results from different machines or versions can
+be compared directly.
+"""
+import argparse
+import contextlib
+import json
+import os
+import platform
+import shutil
+import sys
+import tempfile
+import time
+import numpy as np
+
+from . import _perlin
+from ._version import __version__
+from .util import generate_frames, frame_stream
+from .easy import zebra_noise
+from .perlin_stimulus import PerlinStimulus
+from .server import FrameServer
+from .video import VideoWriter, available_codecs, video_filename
+
+FRAME_SIZES = [(256, 256), (640, 480), (1920, 1080), (3840, 2160)]
+
+def simd_levels():
+    """The SIMD levels supported on this machine"""
+    levels = []
+    prev = _perlin.set_simd("auto")
+    for name in ["scalar", "avx2", "avx512"]:
+        try:
+            _perlin.set_simd(name)
+            levels.append(name)
+        except ValueError:
+            pass
+    _perlin.set_simd(prev)
+    return levels
+
+def timeit(func, repeat):
+    """The best time of `repeat` calls to func, in seconds"""
+    best = np.inf
+    for _ in range(0, repeat):
+        t = time.perf_counter()
+        func()
+        best = min(best, time.perf_counter() - t)
+    return best
+
+def result(name, seconds, samples, frames=None, nbytes=None, **params):
+    """A benchmark result, as a dictionary"""
+    r = dict(name=name, seconds=seconds, samples=int(samples),
+             ns_per_sample=seconds/samples*1e9)
+    if frames is not None:
+        r['frames_per_s'] = frames/seconds
+    if nbytes is not None:
+        r['GB_per_s'] = nbytes/seconds/1e9
+    r.update(params)
+    return r
+
+def bench_noise3(threads, repeat, n=2**20):
+    rng = np.random.default_rng(0)
+    x, y, z = (rng.random(n, dtype="float32")*100 for _ in range(0, 3))
+    results = []
+    for th in threads:
+        t = timeit(lambda : _perlin.noise3(x, y, z, threads=th), repeat)
+        results.append(result("noise3", t, n, nbytes=4*n, threads=th))
+    return results
+
+def bench_make_perlin(sizes, octaves, threads, simd, repeat, samples=2**24):
+    results = []
+    prev = _perlin.set_simd("auto")
+    try:
+        for (xsize, ysize) in sizes:
+            nframes = max(1, samples//(xsize*ysize))
+            xs = np.arange(0, xsize, dtype="float32")/ysize
+            ys = np.arange(0, ysize, dtype="float32")/ysize
+            ts = np.arange(0, nframes, dtype="float32")/50
+            out = np.empty((nframes, ysize, xsize), dtype="float32")
+            n = out.size
+            for level in simd:
+                _perlin.set_simd(level)
+                for octs in octaves:
+                    for th in threads:
+                        t = timeit(lambda : _perlin.make_perlin(xs, ys, ts, octaves=octs, persistence=.5,
+                                                                 repeatx=int(xsize/ysize*100), repeaty=100,
+                                                                 repeatz=nframes, threads=th, layout="zyx", out=out), repeat)
+                        results.append(result("make_perlin", t, n, frames=nframes, nbytes=out.nbytes,
+                                              xsize=xsize, ysize=ysize, octaves=octs, threads=th, simd=level))
+    finally:
+        _perlin.set_simd(prev)
+    return results
+
+def bench_generate_frames(threads, repeat, xsize=640, ysize=480, nframes=60):
+    results = []
+    for th in threads:
+        t = timeit(lambda : generate_frames(xsize, ysize, nframes, np.arange(0, nframes), threads=th, layout="tyx"), repeat)
+        results.append(result("generate_frames", t, xsize*ysize*nframes, frames=nframes,
+                              nbytes=4*xsize*ysize*nframes, xsize=xsize, ysize=ysize, threads=th))
+    return results
+
+def bench_methods(repeat, xsize=1920, ysize=1080, nframes=32):
+    """Each generation method, for few and many octaves"""
+    results = []
+    for method in ["exact", "multires", "incremental", "fixed"]:
+        for (levels, xyscale) in [(1, .2), (10, .2), (10, .5)]:
+            stream = frame_stream(xsize, ysize, 1000, levels=levels, xyscale=xyscale, tscale=50, method=method)
+            out = np.empty((nframes, ysize, xsize), dtype="float32")
+            t = timeit(lambda : stream.frames(0, nframes, out=out), repeat)
+            results.append(result("frame_stream", t, out.size, frames=nframes, nbytes=out.nbytes, xsize=xsize,
+                                  ysize=ysize, levels=levels, xyscale=xyscale, method=method))
+    return results
+
+def bench_frame_server(tmpdir, xsize=1944, ysize=1080, fps=60, tdur=1, nframes=200):
+    """Latency of single frames from a FrameServer, without and with a cache.
+
+    Frames are requested in random order with no LRU, so each one is
+    rendered.  The result's seconds is the median latency, and p50_ms and
+    p99_ms are compared with frame_interval_ms: the target is a 99th
+    percentile below one frame interval.
+    PerlinStimulus needs xsize/ysize*100 to be an integer, so the default
+    is the nearest size to 1920x1080 which has 1080 rows.
+    """
+    cachedir = os.path.join(tmpdir, "server_cache")
+    stim = PerlinStimulus(xsize, ysize, tdur, fps=fps, cachedir=cachedir, delay_batch=True)
+    order = np.random.default_rng(0).integers(0, stim.size[2], nframes)
+    results = []
+    for cached in [False, True]:
+        if cached:
+            stim.generate_batch()
+        times = []
+        with FrameServer(stim, filters=[("comb", .08)], lru_size=0) as server:
+            for t in order:
+                t0 = time.perf_counter()
+                server.get(int(t))
+                times.append(time.perf_counter() - t0)
+        p50, p99 = np.percentile(times, [50, 99])
+        results.append(result("frame_server", p50, xsize*ysize, frames=1, nbytes=xsize*ysize, xsize=xsize,
+                              ysize=ysize, fps=fps, cached=cached, p50_ms=p50*1e3, p99_ms=p99*1e3,
+                              frame_interval_ms=1e3/fps))
+    return results
+
+def bench_zebra_noise(tmpdir, repeat, xsize=640, ysize=480, tdur=4, fps=30):
+    nframes = int(tdur*fps)
+    def run():
+        fn = os.path.join(tmpdir, "zebra.mp4")
+        if os.path.exists(fn):
+            os.unlink(fn)
+        zebra_noise(fn, xsize, ysize, tdur, fps=fps, tscale=30)
+    t = timeit(run, repeat)
+    return [result("zebra_noise", t, xsize*ysize*nframes, frames=nframes, nbytes=xsize*ysize*nframes,
+                   xsize=xsize, ysize=ysize)]
+
+def bench_save_video(tmpdir, repeat, xsize=400, ysize=200, tdur=4, fps=30):
+    cachedir = os.path.join(tmpdir, "cache")
+    stim = PerlinStimulus(xsize, ysize, tdur, fps=fps, tscale=20, cachedir=cachedir, delay_batch=True)
+    nframes = stim.size[2]
+    def generate():
+        shutil.rmtree(cachedir)
+        os.mkdir(cachedir)
+        stim.generate_batch()
+    results = [result("generate_batch", timeit(generate, repeat), xsize*ysize*nframes, frames=nframes,
+                      nbytes=2*xsize*ysize*nframes, xsize=xsize, ysize=ysize)]
+    def save():
+        fn = os.path.join(tmpdir, "stim.mp4")
+        if os.path.exists(fn):
+            os.unlink(fn)
+        stim.save_video(fn, filters=[("comb", .08)])
+    results.append(result("save_video", timeit(save, repeat), xsize*ysize*nframes, frames=nframes,
+                          nbytes=xsize*ysize*nframes, xsize=xsize, ysize=ysize))
+    return results
+
+def bench_encoders(tmpdir, repeat, xsize=1920, ysize=1080, nframes=120):
+    """Encoding binary zebra frames with each codec ffmpeg supports here"""
+    stream = frame_stream(xsize, ysize, nframes, tscale=50)
+    frames = stream.frames(0, nframes, out=np.empty((nframes, ysize, xsize), dtype="uint8"), filters=[("comb", .08)])
+    results = []
+    for codec in available_codecs():
+        fn = video_filename(os.path.join(tmpdir, f"encode_{codec}"), codec)
+        def encode():
+            if os.path.exists(fn):
+                os.unlink(fn)
+            with VideoWriter(fn, xsize, ysize, 30, codec=codec) as writer:
+                writer.write(frames)
+        try:
+            t = timeit(encode, repeat)
+        except RuntimeError: # e.g. a hardware encoder without the hardware
+            continue
+        results.append(result("encode", t, frames.size, frames=nframes, nbytes=frames.nbytes, xsize=xsize,
+                              ysize=ysize, codec=codec, file_bytes=os.path.getsize(fn)))
+    return results
+
+def _reference(x, y, z, octaves, persistence, repeats, base, lacunarity=2.0):
+    """make_perlin(..., layout="zyx") computed as the original per-sample loop over noise3"""
+    Z, Y, X = np.meshgrid(z, y, x, indexing="ij")
+    if octaves == 1:
+        return _perlin.noise3(X, Y, Z, repeatx=repeats[0], repeaty=repeats[1], repeatz=repeats[2], base=base)
+    freq, amp, max_ = np.float32(1), np.float32(1), np.float32(0)
+    total = np.zeros(X.shape, dtype="float32")
+    for l in range(0, octaves):
+        rx, ry, rz = (int(np.float32(r)*freq) for r in repeats)
+        total += _perlin.noise3(X*freq, Y*freq, Z*freq, repeatx=rx, repeaty=ry, repeatz=rz, base=base)*amp
+        max_ += amp
+        freq = np.float32(freq*np.float32(lacunarity))
+        amp = np.float32(amp*np.float32(persistence))
+        if amp < .004:
+            break
+    return total/max_
+
+def check():
+    """Check the claims of bit-for-bit identical output between implementations.
+
+    The SIMD kernels are only identical to the scalar one if the compiler
+    does not fuse multiply-adds (-ffp-contract=off in setup.py), and the
+    caches of existing stimuli rely on it.  For 1 and 10 octaves, both
+    layouts, and axes with and without the lattice wrapping around at the
+    repeat periods, this checks that:
+
+    - make_perlin gives the same output under every level of simd_levels(),
+      in float32 and fixed16 precision
+    - make_perlin matches the original per-sample loop over noise3
+    - make_perlin_batch matches make_perlin
+    - zebranoise.gpu matches make_perlin, if a CUDA device is available
+    - MultiresStream matches PerlinStream when no octave is subsampled, and
+      each region of interest matches the full frame
+
+    Raises AssertionError describing the first difference.
+    """
+    from . import gpu
+    from .multires import MultiresStream
+    x = np.arange(0, 203, dtype="float32")/77 # Not a multiple of the vector width
+    y = np.arange(0, 77, dtype="float32")/77
+    z = np.arange(0, 9, dtype="float32")/4
+    grids = {"wrap": (3, 1, 3), "no wrap": (1024, 1024, 1024)}
+    prev = _perlin.set_simd("auto")
+    try:
+        for (grid, repeats) in grids.items():
+            kw = dict(repeatx=repeats[0], repeaty=repeats[1], repeatz=repeats[2], base=7)
+            for octaves in [1, 10]:
+                for layout in ["xyz", "zyx"]:
+                    case = f"{octaves} octaves, {layout}, {grid}"
+                    for precision in ["float32", "fixed16"]:
+                        outs = {}
+                        for level in simd_levels():
+                            _perlin.set_simd(level)
+                            outs[level] = _perlin.make_perlin(x, y, z, octaves=octaves, persistence=.5, layout=layout,
+                                                              precision=precision, **kw)
+                        _perlin.set_simd(prev)
+                        for level, out in outs.items():
+                            assert np.array_equal(out, outs["scalar"]), f"{level} differs from scalar: {case}, {precision}"
+                    ref = _perlin.make_perlin(x, y, z, octaves=octaves, persistence=.5, layout=layout, **kw)
+                    batch = _perlin.make_perlin_batch(x, y, z, [7], [.5], octaves=octaves, layout=layout,
+                                                      repeatx=repeats[0], repeaty=repeats[1], repeatz=repeats[2])
+                    assert np.array_equal(batch[0], ref), f"make_perlin_batch differs: {case}"
+                    if layout == "zyx":
+                        assert np.array_equal(_reference(x, y, z, octaves, .5, repeats, 7), ref), \
+                            f"make_perlin differs from noise3: {case}"
+                    if gpu.available():
+                        assert np.array_equal(gpu.make_perlin(x, y, z, octaves=octaves, persistence=.5, layout=layout, **kw), ref), \
+                            f"gpu differs: {case}"
+                if octaves > 1:
+                    full = _perlin.PerlinStream(x, y, z, octaves=octaves, persistence=.5, **kw).frames(0, len(z))
+                    exact = MultiresStream(x, y, z, octaves=octaves, persistence=.5, oversample=1e9, **kw)
+                    assert np.array_equal(exact.frames(0, len(z)), full), f"multires differs: {octaves} octaves, {grid}"
+                    whole = MultiresStream(x, y, z, octaves=octaves, persistence=.5, **kw).frames(2, 7)
+                    for (x0, y0, w, h) in [(0, 0, 100, 77), (17, 5, 150, 40), (190, 70, 13, 7)]:
+                        roi = MultiresStream(x, y, z, octaves=octaves, persistence=.5, roi=(x0, y0, w, h), **kw).frames(2, 7)
+                        assert np.array_equal(roi, whole[:,y0:y0+h,x0:x0+w]), f"multires roi differs: {octaves} octaves, {grid}"
+    finally:
+        _perlin.set_simd(prev)
+
+def run(quick=False, video=True, repeat=3):
+    """Run all of the benchmarks.
+
+    Parameters
+    ----------
+    quick : bool
+        Only use the smaller frame sizes and a single repeat
+    video : bool
+        Include the end-to-end benchmarks which encode videos with ffmpeg
+    repeat : int > 0
+        The number of times to repeat each benchmark
+
+    Returns
+    -------
+    dict
+        The machine description under "machine" and the list of results
+        under "results"
+    """
+    if quick:
+        repeat = 1
+    threads = sorted({1, os.cpu_count() or 1})
+    simd = simd_levels()
+    sizes = FRAME_SIZES[0:2] if quick else FRAME_SIZES
+    machine = dict(platform=platform.platform(), processor=platform.processor(),
+                   python=sys.version.split()[0], numpy=np.__version__, zebranoise=__version__,
+                   cpu_count=os.cpu_count(), simd=_perlin.SIMD, simd_levels=simd)
+    results = []
+    results += bench_noise3(threads, repeat)
+    results += bench_make_perlin(sizes, [1, 10], threads, simd, repeat)
+    results += bench_generate_frames(threads, repeat)
+    results += bench_methods(repeat)
+    tmpdir = tempfile.mkdtemp()
+    try:
+        results += bench_frame_server(tmpdir, *((720, 480) if quick else ()))
+    finally:
+        shutil.rmtree(tmpdir)
+    if video:
+        tmpdir = tempfile.mkdtemp()
+        try:
+            results += bench_zebra_noise(tmpdir, repeat)
+            results += bench_save_video(tmpdir, repeat)
+            results += bench_encoders(tmpdir, repeat)
+        finally:
+            shutil.rmtree(tmpdir)
+    return dict(machine=machine, results=results)
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(prog="python -m zebranoise.benchmark", description=__doc__.split("\n")[0])
+    parser.add_argument("-o", "--output", help="Save the results to this JSON file instead of printing them")
+    parser.add_argument("--quick", action="store_true", help="Smaller frames and no repeats")
+    parser.add_argument("--no-video", action="store_true", help="Skip the benchmarks which encode videos")
+    parser.add_argument("--repeat", type=int, default=3, help="Number of repeats of each benchmark")
+    parser.add_argument("--check", action="store_true", help="Only check that the kernels give identical output")
+    args = parser.parse_args(argv)
+    if args.check:
+        check()
+        print(f"Identical output from {', '.join(simd_levels())} and the reference implementations")
+        return
+    # Keep stdout for the JSON
+    with contextlib.redirect_stdout(sys.stderr):
+        results = run(quick=args.quick, video=not args.no_video, repeat=args.repeat)
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(results, f, indent=2)
+    else:
+        print(json.dumps(results, indent=2))
+
+if __name__ == "__main__":
+    main()
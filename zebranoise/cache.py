@@ -0,0 +1,292 @@
+import json
+import os
+import socket
+import zlib
+import numpy as np
+
+MAGIC = b"ZNCACHE1"
+HEADER_SIZE = 4096 # Keeps the frames page-aligned for mmap
+
+class FrameCache:
+    """A single-file, memory-mapped cache of noise frames.
+
+    The file starts with a fixed-size JSON header holding the shape, dtype,
+    parameter key and statistics, followed by the frames stored contiguously
+    in (t,y,x) order.  Frames are memory mapped, so any range of them can be
+    read or updated in place without loading the rest of the file.
+
+    Frames may be stored as float16/float32, or quantised to uint8/uint16.
+    Quantised values q represent q*scale + offset.
+
+    The file may also hold a (y,x) float32 mean after the frames.  It is
+    subtracted from the frames when they are read, so the spatial mean can
+    be removed without rewriting the frames.
+
+    Parameters
+    ----------
+    path : str
+        The cache file to open
+    mode : {'r', 'r+'}
+        Open read-only or for in-place updates
+    """
+    def __init__(self, path, mode="r"):
+        assert mode in ["r", "r+"]
+        self.path = str(path)
+        self.mode = mode
+        with open(self.path, "rb") as f:
+            header = f.read(HEADER_SIZE)
+        if header[0:len(MAGIC)] != MAGIC:
+            raise IOError(f"{self.path} is not a frame cache")
+        self.header = json.loads(header[len(MAGIC):].decode())
+        self.shape = tuple(self.header['shape'])
+        self.dtype = np.dtype(self.header['dtype'])
+        self.frames = np.memmap(self.path, dtype=self.dtype, mode=mode, offset=HEADER_SIZE, shape=self.shape)
+        self.mean = None
+        if self.header.get('mean'):
+            self.mean = np.memmap(self.path, dtype="float32", mode=mode, offset=HEADER_SIZE+self.frames.nbytes, shape=self.shape[1:])
+    @classmethod
+    def create(cls, path, shape, dtype="float16", key="", offset=0.0, scale=1.0, mean=False):
+        """Create an empty cache file and open it for writing.
+
+        Parameters
+        ----------
+        path : str
+            The file to create.  It is overwritten if it exists.
+        shape : tuple of int
+            The (t,y,x) shape of the frames
+        dtype : {'float16', 'float32', 'uint8', 'uint16'}
+            How the frames are stored
+        key : str
+            An identifier for the parameters used to generate the frames
+        offset, scale : float
+            The quantisation of integer dtypes
+        mean : bool
+            Whether to reserve space for a mean to subtract from the frames
+
+        Returns
+        -------
+        FrameCache
+            The new cache, opened in 'r+' mode
+        """
+        dtype = np.dtype(dtype)
+        assert dtype.name in ["float16", "float32", "uint8", "uint16"], "Invalid cache dtype"
+        assert len(shape) == 3, "Shape must be (t,y,x)"
+        header = {"shape": [int(s) for s in shape], "dtype": dtype.name, "key": key,
+                  "offset": float(offset), "scale": float(scale), "stats": {}, "complete": False,
+                  "mean": bool(mean)}
+        with open(path, "wb") as f:
+            f.write(cls._pack_header(header))
+            # Sparse on most filesystems until the frames are written
+            f.truncate(HEADER_SIZE + int(np.prod(shape))*dtype.itemsize + (4*shape[1]*shape[2] if mean else 0))
+        return cls(path, mode="r+")
+    @classmethod
+    def open_or_create(cls, path, shape, dtype="float16", key="", mean=False):
+        """Open a cache for writing, creating it if it does not exist.
+
+        This is safe to call from several processes, or several machines
+        sharing a filesystem, at once: exactly one of them creates the file,
+        and the others open it.  The new file is prepared under a private
+        name and then hard linked into place, so a partially written header
+        is never seen.
+
+        Parameters are as for create.  An existing cache must have the same
+        shape, dtype and key, otherwise IOError is raised.
+        """
+        tmp = f"{path}.{socket.gethostname()}.{os.getpid()}"
+        cls.create(tmp, shape, dtype=dtype, key=key, mean=mean).close()
+        try:
+            os.link(tmp, path)
+        except FileExistsError:
+            pass
+        finally:
+            os.unlink(tmp)
+        cache = cls(path, mode="r+")
+        if cache.shape != tuple(shape) or cache.dtype != np.dtype(dtype) or cache.header['key'] != key:
+            raise IOError(f"{path} exists but holds a different stimulus")
+        return cache
+    @staticmethod
+    def _pack_header(header):
+        data = MAGIC + json.dumps(header).encode()
+        assert len(data) < HEADER_SIZE, "Cache header too large"
+        return data + b" "*(HEADER_SIZE - len(data) - 1) + b"\n"
+    def _write_header(self):
+        assert self.mode == "r+", "Cache is read-only"
+        with open(self.path, "r+b") as f:
+            f.write(self._pack_header(self.header))
+    @property
+    def stats(self):
+        """Statistics saved with the frames, e.g. min_ and max_"""
+        return self.header['stats']
+    @property
+    def complete(self):
+        """Whether all of the frames have been written"""
+        return self.header['complete']
+    @property
+    def quantised(self):
+        return self.dtype.kind == "u"
+    def set_stats(self, complete=None, **stats):
+        """Save statistics in the header and optionally mark the cache complete."""
+        self.header['stats'].update({k: float(v) for k,v in stats.items()})
+        if complete is not None:
+            self.header['complete'] = bool(complete)
+        self._write_header()
+    def read(self, start, stop=None, demean=True):
+        """Return frames start to stop as float32, undoing any quantisation.
+
+        The mean, if there is one, is subtracted unless demean is False.
+        """
+        stop = start+1 if stop is None else stop
+        data = self.frames[start:stop].astype("float32")
+        if self.quantised:
+            data *= self.header['scale']
+            data += self.header['offset']
+        if demean and self.mean is not None:
+            data -= self.mean[None,:,:]
+        return data
+    def write(self, start, frames):
+        """Overwrite frames starting at start, quantising if necessary.
+
+        No mean is added back, so frames should be as they were generated.
+        """
+        assert self.mode == "r+", "Cache is read-only"
+        if self.quantised:
+            frames = (np.asarray(frames, dtype="float32") - self.header['offset']) / self.header['scale']
+            info = np.iinfo(self.dtype)
+            frames = np.clip(np.round(frames), info.min, info.max)
+        self.frames[start:start+len(frames)] = frames
+    def checksum(self, start, stop):
+        """The CRC-32 of the stored frames start to stop-1"""
+        return zlib.crc32(self.frames[start:stop])
+    def raw_range(self, lo, hi):
+        """Convert the value range (lo, hi) to the range of the stored frames.
+
+        Use this to pass the cache's frames to _perlin.postprocess directly.
+        """
+        if not self.quantised:
+            return (lo, hi)
+        return ((lo - self.header['offset'])/self.header['scale'], (hi - self.header['offset'])/self.header['scale'])
+    def raw_mean(self):
+        """The mean in the units of the stored frames, or None
+
+        Pass it to _perlin.postprocess along with raw_range.
+        """
+        if self.mean is None or not self.quantised:
+            return self.mean
+        return np.asarray(self.mean)/np.float32(self.header['scale'])
+    def flush(self):
+        if self.mode == "r+" and self.frames is not None:
+            self.frames.flush()
+            if self.mean is not None:
+                self.mean.flush()
+    def close(self):
+        """Flush and release the memory maps.  It is safe to call this again."""
+        self.flush()
+        self.frames = None
+        self.mean = None
+
+class Manifest:
+    """A record of which frames of a cache have been generated.
+
+    It is kept as a JSON file next to the cache, and rewritten after each
+    batch of frames, so an interrupted generation can be resumed.  Each
+    batch is stored with a checksum of its frames, so frames which were
+    never written to the disk, or were damaged, are found and generated
+    again.
+
+    Parameters
+    ----------
+    path : str
+        The manifest file
+    key : str
+        The key of the cache, see PerlinStimulus.cache_key
+    params : dict
+        The parameters which determine the frames, apart from their number
+    nframes : int
+        The number of frames in the cache
+    file : str
+        The name of the cache file holding the frames, in the same directory
+    batches : list of [start, stop, crc32]
+        The batches of frames which have been written
+    """
+    def __init__(self, path, key, params, nframes, file, batches=()):
+        self.path = str(path)
+        self.key = key
+        self.params = params
+        self.nframes = nframes
+        self.file = file
+        self.batches = [list(b) for b in batches]
+    @classmethod
+    def load(cls, path):
+        """Load a manifest, or return None if it does not exist or is unreadable"""
+        try:
+            with open(path) as f:
+                m = json.load(f)
+            return cls(path, m['key'], m['params'], m['nframes'], m['file'], m['batches'])
+        except (OSError, ValueError, KeyError):
+            return None
+    def save(self):
+        """Write the manifest, replacing the old one atomically"""
+        tmp = self.path + ".tmp"
+        with open(tmp, "w") as f:
+            json.dump(dict(key=self.key, params=self.params, nframes=self.nframes, file=self.file,
+                           batches=self.batches), f)
+        os.replace(tmp, self.path)
+    def cache_path(self):
+        """The path of the cache file"""
+        return os.path.join(os.path.dirname(self.path), self.file)
+    def add(self, start, stop, crc):
+        """Record that frames start to stop-1 have been written, with checksum crc"""
+        self.batches.append([int(start), int(stop), int(crc)])
+        self.batches.sort()
+    def verify(self, cache):
+        """Drop the batches whose frames in cache do not match their checksums"""
+        self.batches = [b for b in self.batches if cache.checksum(b[0], b[1]) == b[2]]
+    def prefix(self):
+        """The number of frames written contiguously from the first"""
+        n = 0
+        for start, stop, _ in self.batches:
+            if start > n:
+                break
+            n = max(n, stop)
+        return n
+    def missing(self):
+        """The (start, stop) ranges of frames which have not been written"""
+        gaps, n = [], 0
+        for start, stop, _ in self.batches:
+            if start > n:
+                gaps.append((n, start))
+            n = max(n, stop)
+        if n < self.nframes:
+            gaps.append((n, self.nframes))
+        return gaps
+
+def quantise(cache, path, dtype, lo, hi):
+    """Copy a cache to a new file, quantising the values in [lo, hi].
+
+    Parameters
+    ----------
+    cache : FrameCache
+        The cache to copy, with float frames
+    path : str
+        The new cache file
+    dtype : {'uint8', 'uint16'}
+        The integer type to store
+    lo, hi : float
+        The range of the stored values to represent, i.e. before
+        subtracting any mean
+
+    Returns
+    -------
+    FrameCache
+        The new cache, opened in 'r+' mode
+    """
+    info = np.iinfo(dtype)
+    new = FrameCache.create(path, cache.shape, dtype=dtype, key=cache.header['key'],
+                            offset=lo, scale=(hi-lo)/info.max if hi > lo else 1.0, mean=cache.mean is not None)
+    step = max(1, int(2**26/(cache.shape[1]*cache.shape[2])))
+    for start in range(0, cache.shape[0], step):
+        new.write(start, cache.read(start, min(cache.shape[0], start+step), demean=False))
+    if cache.mean is not None:
+        new.mean[:] = cache.mean
+    new.set_stats(**cache.stats)
+    return new
@@ -1,9 +1,28 @@
-import imageio
+import os
+import numpy as np
 from tqdm import tqdm
 import warnings
-from .util import generate_frames, filter_frames_index_function, apply_filters, discretize
+from .util import frame_stream, apply_filters, discretize, can_fuse, split_overlays, apply_overlays, filter_name
+from .video import VideoWriter
+from .pipeline import run_pipeline
+from .realtime import RealtimeRenderer
+from .jobs import Job, Cancelled, NULL_JOB
+from .playback import playback_plan, render_plan, write_grey
 
-def zebra_noise(output_file, xsize, ysize, tdur, levels=10, xyscale=.2, tscale=50, fps=30, xscale=1.0, yscale=1.0, seed=0, filters=[("comb", 0.08)]):
+def _zebra_stream(xsize, ysize, tdur, levels, xyscale, tscale, fps, xscale, yscale, seed, method, roi=None, filters=[]):
+    """The number of frames and the PerlinStream for zebra_noise"""
+    if roi is not None and "blur" in [filter_name(f) for f in filters]:
+        raise ValueError("The blur filter needs whole frames, so it cannot be used with roi")
+    tsize = int(tdur*fps)
+    tscale = tscale * (fps/30)
+    textra = (tscale - (tsize % tscale)) % tscale
+    if textra > 0:
+        warnings.warn(f"Adding {textra} extra timepoints to make tscale a multiple of tdur")
+    tsize += round(textra)
+    stream = frame_stream(xsize, ysize, tsize, levels=levels, xyscale=xyscale, tscale=tscale, xscale=xscale, yscale=yscale, seed=seed, method=method, roi=roi)
+    return tsize, stream
+
+def zebra_noise(output_file, xsize, ysize, tdur, levels=10, xyscale=.2, tscale=50, fps=30, xscale=1.0, yscale=1.0, seed=0, filters=[("comb", 0.08)], chunk_size=64, queue_depth=4, workers=1, method="exact", job=None, bitrate=20, codec="mpeg2", threads=0, loop=1, pad=0, roi=None):
     """Generate a .mp4 of zebra noise.
 
     This method is a simplified interface for the PerlinStimulus class, designed to only generate zebra noise
@@ -29,23 +48,148 @@ def zebra_noise(output_file, xsize, ysize, tdur, levels=10, xyscale=.2, tscale=5
         Frames per second
     seed : int
         Random seed
+    chunk_size : int > 0
+        The number of frames generated at a time
+    queue_depth : int > 0
+        The number of chunks which may wait to be encoded
+    workers : int > 0
+        The number of threads generating and filtering chunks
+    method : {'exact', 'multires', 'incremental', 'fixed'}
+        Use 'multires' to generate the coarse octaves on coarser grids,
+        which is faster and gives statistically equivalent noise,
+        'incremental' to reuse the slowly changing octaves between frames,
+        which is exact up to rounding, or 'fixed' to compute the noise in
+        16-bit fixed point, which is faster for large frames and changes
+        at most about 1% of pixels by one grey level
+    job : zebranoise.jobs.Job, optional
+        The job this runs in, which receives the number of frames encoded
+        and is checked for cancellation before each chunk.  A cancelled
+        video is deleted.  See zebra_noise_async.
+    bitrate : int > 0
+        The bitrate in megabits per second
+    codec : str
+        The encoder to use, as for PerlinStimulus.save_video
+    threads : int >= 0
+        The number of encoder threads, or 0 for ffmpeg's default
+    loop : int > 0
+        The number of times the noise should loop in the video.  It is only
+        generated and encoded once.
+    pad : float >= 0
+        The duration in seconds of grey screen to show after each loop
+    roi : (int, int, int, int), optional
+        Only save the region of interest (x0, y0, width, height) of the
+        frames, e.g. the part shown on one monitor, see
+        zebranoise.util.tiles.  Its pixels are identical to those of the
+        full video, including any photodiode markers.
     
     Returns
     -------
     None, but saves the video file to the desired filename
     """ 
-    tsize = int(tdur*fps)
-    tscale = tscale * (fps/30)
-    textra = (tscale - (tsize % tscale)) % tscale
-    if textra > 0:
-        warnings.warn(f"Adding {textra} extra timepoints to make tscale a multiple of tdur")
-    tsize += round(textra)
-    get_index = filter_frames_index_function(filters, tsize)
-    writer = imageio.get_writer(output_file, fps=fps)
-    for _i in tqdm(range(0, tsize)):
-        i = get_index(_i)
-        frame = generate_frames(xsize, ysize, tsize, [i], levels=levels, xyscale=xyscale, tscale=tscale, xscale=xscale, yscale=yscale, seed=seed)
-        filtered = apply_filters(frame[None], filters)[0] # TODO I don't think this will work with the photodiode filter
-        disc = discretize(filtered[:,:,0])
-        writer.append_data(disc)
-    writer.close()
+    tsize, stream = _zebra_stream(xsize, ysize, tdur, levels, xyscale, tscale, fps, xscale, yscale, seed, method, roi, filters)
+    width, height = (xsize, ysize) if roi is None else roi[2:]
+    # If possible, filter and discretize in C as each frame is generated.
+    # Markers are drawn into the uint8 frames afterwards.
+    reverse = "reverse" in filters
+    filters, overlays = split_overlays(filters)
+    fused = can_fuse(filters)
+    chunks = [(i, min(i+chunk_size, tsize)) for i in range(0, tsize, chunk_size)]
+    if reverse:
+        chunks = [(tsize-j, tsize-i) for i,j in chunks]
+    plan = playback_plan(tsize, loop, reverse, int(pad*fps))
+    total = sum(seg.stop-seg.start for seg in dict.fromkeys(plan))
+    job = NULL_JOB if job is None else job
+    progress = tqdm(total=total)
+    def generate(chunk):
+        job.check()
+        if fused:
+            out = np.empty((chunk[1]-chunk[0], height, width), dtype="uint8")
+            return apply_overlays(stream.frames(*chunk, out=out, filters=filters), overlays, chunk[0], roi, (xsize, ysize))
+        # Frame-major output, so the (y,x,t) view below is contiguous in
+        # memory for each frame.
+        frames = stream.frames(*chunk)
+        filtered = apply_filters(frames.transpose([1,2,0]), filters, chunk[0], roi, (xsize, ysize))
+        return apply_overlays(np.moveaxis(discretize(filtered), 2, 0), overlays, chunk[0], roi, (xsize, ysize))
+    def encode_segment(seg, fn):
+        with VideoWriter(fn, width, height, fps, bitrate, codec=codec, threads=threads) as writer:
+            def encode(frames):
+                writer.write(frames[::-1] if reverse else frames)
+                progress.update(len(frames))
+                job.report(progress.n, total)
+            if seg.kind == "grey":
+                job.check()
+                write_grey(writer, seg.stop-seg.start)
+                progress.update(seg.stop-seg.start)
+                job.report(progress.n, total)
+                return
+            # Generating chunk k+1 overlaps with encoding chunk k
+            run_pipeline(chunks, [(generate, workers), encode], depth=queue_depth)
+    try:
+        render_plan(output_file, plan, encode_segment, codec)
+    except Cancelled:
+        if os.path.isfile(output_file):
+            os.unlink(output_file)
+        raise
+    finally:
+        progress.close()
+
+def zebra_noise_async(output_file, *args, progress=None, **kwargs):
+    """Run zebra_noise on a background thread.
+
+    Takes the same arguments as zebra_noise, and returns a
+    zebranoise.jobs.Job which can be awaited or cancelled.  For example,
+    in a coroutine::
+
+        job = zebra_noise_async("out.mp4", 1920, 1080, 600, progress=show_progress)
+        await job
+
+    Parameters
+    ----------
+    progress : function, optional
+        progress(done, total) is called with the number of frames encoded,
+        from the job's thread
+    """
+    return Job(lambda job : zebra_noise(output_file, *args, job=job, **kwargs), progress=progress)
+
+def zebra_noise_realtime(xsize, ysize, tdur, levels=10, xyscale=.2, tscale=50, fps=30, xscale=1.0, yscale=1.0, seed=0, filters=[("comb", 0.08)], prefetch=8, loop=False, method="exact", roi=None):
+    """Present zebra noise live, instead of saving it as a video.
+
+    Takes the same arguments as zebra_noise, and returns a RealtimeRenderer
+    which renders the same frames as it would save, a few frames ahead of
+    a clock running at `fps`.  For example::
+
+        with zebra_noise_realtime(1920, 1080, 3600, fps=60) as r:
+            for t, frame in r:
+                show(frame)
+        print(r.report())
+
+    To split the stimulus across several monitors, create one renderer
+    for each, passing its part of the frame as `roi`::
+
+        renderers = [zebra_noise_realtime(5760, 1080, 3600, fps=60, roi=roi)
+                     for roi in zebranoise.tiles(5760, 1080, columns=3)]
+
+    Parameters
+    ----------
+    prefetch : int > 0
+        The number of frames to render ahead
+    loop : bool
+        Start again from the first frame at the end, rather than stopping
+
+    See zebranoise.realtime.RealtimeRenderer for the rest.
+    """
+    tsize, stream = _zebra_stream(xsize, ysize, tdur, levels, xyscale, tscale, fps, xscale, yscale, seed, method, roi, filters)
+    width, height = (xsize, ysize) if roi is None else roi[2:]
+    reverse = "reverse" in filters
+    filters, overlays = split_overlays(filters)
+    fused = can_fuse(filters)
+    def render(t, out):
+        if reverse:
+            t = tsize - 1 - t
+        if fused:
+            stream.frames(t, t+1, out=out[None], filters=filters)
+        else:
+            filtered = apply_filters(np.moveaxis(stream.frames(t, t+1), 0, 2), filters, t, roi, (xsize, ysize))
+            out[...] = discretize(filtered)[:,:,0]
+        apply_overlays(out[None], overlays, t, roi, (xsize, ysize))
+    return RealtimeRenderer(render, tsize, (height, width), fps, prefetch=prefetch, loop=loop)
@@ -0,0 +1,358 @@
+"""Optional CUDA backend for the noise kernel, using CuPy.
+
+make_perlin and GPUStream take the same arguments as _perlin.make_perlin
+and _perlin.PerlinStream.  The per-axis lattice tables are built on the
+host exactly as the C extension builds them and copied to the device, and
+each GPU thread then computes one sample.  The kernel is compiled without
+fused multiply-adds and uses the same order of operations as the C
+kernel, so the raw noise is identical to the CPU output.  Of the filters,
+only "softthresh" may differ in the last bit, since it uses the device's
+expf.
+
+Results stay on the device if `out` is a CuPy array or `device=True` is
+passed.  Device arrays support DLPack and __cuda_array_interface__, so
+they can be handed to a hardware encoder or to OpenGL/CUDA interop for
+display without copying through host memory.
+
+This module needs CuPy and a CUDA device, see available().
+"""
+import numpy as np
+
+from . import _perlin
+
+try:
+    import cupy
+except ImportError:
+    cupy = None
+
+# From _perlin.c
+GRAD3 = np.asarray([[1,1,0],[-1,1,0],[1,-1,0],[-1,-1,0],
+                    [1,0,1],[-1,0,1],[1,0,-1],[-1,0,-1],
+                    [0,1,1],[0,-1,1],[0,1,-1],[0,-1,-1],
+                    [1,0,-1],[-1,0,-1],[0,-1,1],[0,1,1]], dtype="float32")
+
+# Filter operations, in the same order as the enum in _perlin.c
+FILTER_OPS = {"threshold": 0, "softthresh": 1, "comb": 2, "invert": 3, "wood": 4, "center": 5}
+MAX_FILTERS = 16
+
+_SOURCE = r"""
+#define lerp(t, a, b) ((a) + (t) * ((b) - (a)))
+
+__constant__ unsigned char PERM[512];
+__constant__ float GRAD3[16][3];
+
+__device__ __forceinline__ float
+grad3(const int hash, const float x, const float y, const float z)
+{
+	const int h = hash & 15;
+	return x * GRAD3[h][0] + y * GRAD3[h][1] + z * GRAD3[h][2];
+}
+
+__device__ __forceinline__ float
+floordivf(const float a, const float b)
+{
+	const float mod = fmodf(a, b);
+	float div = (a - mod) / b;
+	float floordiv;
+	if (mod && ((b < 0) != (mod < 0)))
+		div -= 1.0f;
+	if (div) {
+		floordiv = floorf(div);
+		if (div - floordiv > 0.5f)
+			floordiv += 1.0f;
+	} else
+		floordiv = copysignf(0.0f, a / b);
+	return floordiv;
+}
+
+__device__ __forceinline__ float
+remainderf_py(const float a, const float b)
+{
+	float mod = fmodf(a, b);
+	if (mod) {
+		if ((b < 0) != (mod < 0))
+			mod += b;
+	} else
+		mod = copysignf(0.0f, b);
+	return mod;
+}
+
+__device__ __forceinline__ float
+apply_filter(const int op, const float arg, const float v)
+{
+	switch (op) {
+	case 0:
+		return v > arg ? 1.0f : 0.0f;
+	case 1:
+		return 1.0f/(1.0f + expf(-arg*(v - 0.5f)));
+	case 2:
+		return fabsf(fmodf(floordivf(v, arg), 2.0f)) == 1.0f ? 1.0f : 0.0f;
+	case 3:
+		return 1.0f - v;
+	case 4:
+		return remainderf_py(v, arg) / arg;
+	case 5:
+		return 1.0f - (fabsf(v - 0.5f) * 2.0f);
+	default:
+		return v;
+	}
+}
+
+// One thread per sample of the (z1-z0, len_y, len_x) block of frames for
+// layout 1 ("zyx"), or of the (len_x, len_y, z1-z0) block for layout 0
+// ("xyz").  The tables are (levels, len) arrays for each axis.
+template<typename T>
+__device__ void
+perlin_grid(const int *xlo, const int *xhi, const float *xt, const float *xf,
+	const int *ylo, const int *yhi, const float *yt, const float *yf,
+	const int *zlo, const int *zhi, const float *zt, const float *zf,
+	const float *amp, const int levels, const int single, const float max,
+	const int len_x, const int len_y, const int len_z, const int z0, const int z1,
+	const int layout, const int normalise, const float min, const float scale,
+	const int nfilters, const int *ops, const float *args, T *out)
+{
+	const long long n = (long long)len_x*len_y*(z1 - z0);
+	const long long r = (long long)blockIdx.x*blockDim.x + threadIdx.x;
+	if (r >= n)
+		return;
+	int i, j, k;
+	if (layout == 1) {
+		i = (int)(r % len_x);
+		j = (int)((r / len_x) % len_y);
+		k = z0 + (int)(r / ((long long)len_x*len_y));
+	} else {
+		k = z0 + (int)(r % (z1 - z0));
+		j = (int)((r / (z1 - z0)) % len_y);
+		i = (int)(r / ((long long)(z1 - z0)*len_y));
+	}
+	float total = 0.0f;
+	int l;
+	for (l = 0; l < levels; l++) {
+		const int ox = l*len_x + i, oy = l*len_y + j, oz = l*len_z + k;
+		const int A = xlo[ox], B = xhi[ox], j0 = ylo[oy], j1 = yhi[oy];
+		const int AA = PERM[A + j0], AB = PERM[A + j1], BA = PERM[B + j0], BB = PERM[B + j1];
+		const int kl = zlo[oz], kh = zhi[oz];
+		const float x = xt[ox], y = yt[oy], z = zt[oz];
+		const float fx = xf[ox], fy = yf[oy], fz = zf[oz];
+		const float v = lerp(fz, lerp(fy, lerp(fx, grad3(PERM[AA + kl], x, y, z),
+												   grad3(PERM[BA + kl], x - 1, y, z)),
+										  lerp(fx, grad3(PERM[AB + kl], x, y - 1, z),
+												   grad3(PERM[BB + kl], x - 1, y - 1, z))),
+								 lerp(fy, lerp(fx, grad3(PERM[AA + kh], x, y, z - 1),
+												   grad3(PERM[BA + kh], x - 1, y, z - 1)),
+										  lerp(fx, grad3(PERM[AB + kh], x, y - 1, z - 1),
+												   grad3(PERM[BB + kh], x - 1, y - 1, z - 1))));
+		if (single)
+			total = v;
+		else if (l == 0)
+			total = 0.0f + v * amp[l];
+		else
+			total += v * amp[l];
+	}
+	if (!single)
+		total = (float) (total / max);
+	if (normalise) {
+		total -= min;
+		total *= scale;
+	}
+	int f;
+	for (f = 0; f < nfilters; f++)
+		total = apply_filter(ops[f], args[f], total);
+	if (sizeof(T) == 1) {
+		const float q = total * 255;
+		out[r] = q <= 0 ? 0 : q >= 255 ? 255 : (unsigned char)q;
+	} else
+		out[r] = total;
+}
+
+#define GRID_ARGS \
+	const int *xlo, const int *xhi, const float *xt, const float *xf, \
+	const int *ylo, const int *yhi, const float *yt, const float *yf, \
+	const int *zlo, const int *zhi, const float *zt, const float *zf, \
+	const float *amp, const int levels, const int single, const float max, \
+	const int len_x, const int len_y, const int len_z, const int z0, const int z1, \
+	const int layout, const int normalise, const float min, const float scale, \
+	const int nfilters, const int *ops, const float *args
+#define GRID_CALL xlo, xhi, xt, xf, ylo, yhi, yt, yf, zlo, zhi, zt, zf, amp, levels, \
+	single, max, len_x, len_y, len_z, z0, z1, layout, normalise, min, scale, nfilters, ops, args
+
+extern "C" __global__ void
+perlin_grid_float(GRID_ARGS, float *out)
+{
+	perlin_grid<float>(GRID_CALL, out);
+}
+
+extern "C" __global__ void
+perlin_grid_uint8(GRID_ARGS, unsigned char *out)
+{
+	perlin_grid<unsigned char>(GRID_CALL, out);
+}
+"""
+
+_module = None
+
+def available():
+    """Whether CuPy is installed and a CUDA device can be used"""
+    if cupy is None:
+        return False
+    try:
+        return cupy.cuda.runtime.getDeviceCount() > 0
+    except Exception:
+        return False
+
+def _get_module():
+    global _module
+    if _module is None:
+        if not available():
+            raise RuntimeError("The GPU backend needs CuPy and a CUDA device")
+        # No fused multiply-adds, as for -ffp-contract=off in setup.py
+        _module = cupy.RawModule(code=_SOURCE, options=("--fmad=false",))
+        perm = cupy.ndarray((512,), dtype="uint8", memptr=_module.get_global("PERM"))
+        perm[...] = cupy.asarray(_perm_table())
+        grad = cupy.ndarray(GRAD3.shape, dtype="float32", memptr=_module.get_global("GRAD3"))
+        grad[...] = cupy.asarray(GRAD3)
+    return _module
+
+def _perm_table():
+    """The PERM table of the C extension"""
+    return np.frombuffer(_perlin.PERM, dtype="uint8")
+
+def _axis_tables(v, freq, levels, lacunarity, repeat, base, hash):
+    """The lattice tables for one axis, as lattice_axis_fill in _perlin.c"""
+    v = np.asarray(v, dtype="float32")
+    lo = np.empty((levels, len(v)), dtype="int32")
+    hi = np.empty((levels, len(v)), dtype="int32")
+    ts = np.empty((levels, len(v)), dtype="float32")
+    fs = np.empty((levels, len(v)), dtype="float32")
+    perm = _perm_table()
+    for l in range(0, levels):
+        t = v * freq
+        c = t.astype("int32")
+        lo[l] = (c + base) & 255
+        hi[l] = (((c + 1) % int(np.float32(repeat)*freq)) + base) & 255
+        if hash:
+            lo[l] = perm[lo[l]]
+            hi[l] = perm[hi[l]]
+        t = t - c.astype("float32")
+        ts[l] = t
+        fs[l] = t*t*t * (t * (t * np.float32(6) - np.float32(15)) + np.float32(10))
+        freq = np.float32(freq * lacunarity)
+    return lo, hi, ts, fs
+
+def _parse_output(filters, norm, out_type):
+    """The normalisation and filters, as parse_output in _perlin.c"""
+    normalise, min_, scale = 0, 0.0, 1.0
+    if norm is not None:
+        if not norm[1] > norm[0]:
+            raise ValueError("norm must be (min, max) with max > min")
+        normalise, min_, scale = 1, np.float32(norm[0]), np.float32(1)/(np.float32(norm[1]) - np.float32(norm[0]))
+    elif not filters and out_type == np.uint8: # None or empty, as in _perlin.c
+        normalise, min_, scale = 1, -1.0, 0.5
+    ops, args = [], []
+    for f in filters or []:
+        name, fargs = (f, ()) if isinstance(f, str) else (f[0], tuple(f[1:]))
+        if name == "reverse":
+            continue
+        if name not in FILTER_OPS:
+            raise ValueError("Invalid filter specified, or filter not supported on the GPU")
+        ops.append(FILTER_OPS[name])
+        args.append(fargs[0] if fargs else 0.0)
+    if len(ops) > MAX_FILTERS:
+        raise ValueError("Too many filters")
+    return normalise, np.float32(min_), np.float32(scale), ops, args
+
+class GPUStream:
+    """The GPU counterpart of _perlin.PerlinStream.
+
+    Takes the same arguments, and keeps the lattice tables on the device so
+    that any range of frames can be generated without copying anything
+    from the host.  `threads` is accepted for compatibility and ignored.
+    """
+    def __init__(self, x, y, z, octaves=1, persistence=.5, lacunarity=2.0, repeatx=1024, repeaty=1024, repeatz=1024, base=0, threads=0):
+        if not 0 <= base <= 255:
+            raise ValueError("Base must be between 0 and 255")
+        if octaves < 1:
+            raise ValueError("Expected octaves value > 0")
+        x, y, z = (np.asarray(a, dtype="float32").ravel() for a in (x, y, z))
+        if min(len(x), len(y), len(z)) < 1:
+            raise ValueError("x, y and z must each have at least one element")
+        if x[-1] >= repeatx or y[-1] >= repeaty or z[-1] >= repeatz:
+            raise ValueError("Cannot pass values greater than repeatx/y/z")
+        self.module = _get_module()
+        # Same octave schedule as lattice_build
+        persistence, lacunarity = np.float32(persistence), np.float32(lacunarity)
+        amps = []
+        amp = np.float32(1)
+        for l in range(0, octaves):
+            amps.append(amp)
+            amp = np.float32(amp * persistence)
+            if float(amp) < .004: # Compared as a double, as in C
+                break
+        self.levels = len(amps)
+        self.amp = cupy.asarray(np.asarray(amps, dtype="float32"))
+        self.max = np.float32(0)
+        for a in amps:
+            self.max = np.float32(self.max + a)
+        self.single = int(octaves == 1)
+        self.len_x, self.len_y, self.len_z = len(x), len(y), len(z)
+        self.tables = []
+        for (v, rep, h) in [(x, repeatx, 1), (y, repeaty, 0), (z, repeatz, 0)]:
+            self.tables += [cupy.asarray(a) for a in _axis_tables(v, np.float32(1), self.levels, lacunarity, rep, base, h)]
+    def __len__(self):
+        return self.len_z
+    def _grid(self, layout, z0, z1, out, filters, norm):
+        out_type = np.dtype(out.dtype).type
+        normalise, min_, scale, ops, args = _parse_output(filters, norm, out_type)
+        kernel = self.module.get_function("perlin_grid_uint8" if out_type == np.uint8 else "perlin_grid_float")
+        n = self.len_x*self.len_y*(z1-z0)
+        block = 256
+        kernel(((n + block - 1)//block,), (block,),
+               (*self.tables, self.amp, np.int32(self.levels), np.int32(self.single), self.max,
+                np.int32(self.len_x), np.int32(self.len_y), np.int32(self.len_z), np.int32(z0), np.int32(z1),
+                np.int32(layout), np.int32(normalise), min_, scale, np.int32(len(ops)),
+                cupy.asarray(np.asarray(ops + [0], dtype="int32")), cupy.asarray(np.asarray(args + [0], dtype="float32")),
+                out))
+        return out
+    def frames(self, start, stop=None, out=None, filters=None, norm=None, device=False):
+        """Generate frames start to stop-1 as a contiguous (t,y,x) array.
+
+        As for PerlinStream.frames.  The result is a CuPy array if out is
+        one or device is True, and a numpy array otherwise.
+        """
+        stop = start+1 if stop is None else stop
+        if start < 0 or stop > self.len_z or start >= stop:
+            raise IndexError("Frame range out of bounds")
+        return _run(lambda o: self._grid(1, start, stop, o, filters, norm),
+                    (stop-start, self.len_y, self.len_x), out, device)
+
+def _run(grid, shape, out, device):
+    """Call grid with a device output of the given shape, and return it where it was asked for"""
+    if out is not None and (np.dtype(out.dtype) not in [np.float32, np.uint8] or tuple(out.shape) != tuple(shape)
+                            or not out.flags.c_contiguous):
+        raise ValueError("out must be a writable C-contiguous float32 or uint8 array of the output shape")
+    if cupy is not None and isinstance(out, cupy.ndarray):
+        return grid(out)
+    dout = cupy.empty(shape, dtype=out.dtype if out is not None else "float32")
+    grid(dout)
+    if out is not None:
+        dout.get(out=out)
+        return out
+    return dout if device else dout.get()
+
+def make_perlin(x, y, z, octaves=1, persistence=.5, lacunarity=2.0, repeatx=1024, repeaty=1024, repeatz=1024, base=0, threads=0, layout="xyz", out=None, filters=None, norm=None, device=False):
+    """The GPU counterpart of _perlin.make_perlin.
+
+    Takes the same arguments and returns the same values.  The result is a
+    CuPy array if out is one or device is True, and a numpy array
+    otherwise.  `threads` is ignored.
+    """
+    if layout not in ["xyz", "zyx"]:
+        raise ValueError("Layout must be 'xyz' or 'zyx'")
+    stream = GPUStream(x, y, z, octaves=octaves, persistence=persistence, lacunarity=lacunarity,
+                       repeatx=repeatx, repeaty=repeaty, repeatz=repeatz, base=base)
+    nz = stream.len_z
+    if layout == "zyx":
+        shape = (nz, stream.len_y, stream.len_x)
+    else:
+        shape = (stream.len_x, stream.len_y, nz)
+    return _run(lambda o: stream._grid(1 if layout == "zyx" else 0, 0, nz, o, filters, norm), shape, out, device)
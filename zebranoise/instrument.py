@@ -0,0 +1,100 @@
+import contextlib
+import json
+import os
+import threading
+import time
+
+from . import _perlin
+
+class _NullContext:
+    def __enter__(self):
+        return self
+    def __exit__(self, *args):
+        return False
+
+_NULL = _NullContext()
+
+class Instrumentation:
+    """Opt-in timers and counters for the stages of generating a stimulus.
+
+    Each stage (e.g. "generate", "filter", "encode") records the number of
+    calls, wall-clock and CPU time, frames, and bytes read, written and
+    allocated.  Disabled instances cost only a function call per stage.
+    Stages may run on several threads at once, as in run_pipeline.  CPU
+    time is for the whole process, so it is counted in every stage running
+    at the time.
+
+    If enabled, each call is also kept as an event for write_trace.
+
+    Parameters
+    ----------
+    enabled : bool
+        Whether to record anything
+    """
+    def __init__(self, enabled=False):
+        self.enabled = enabled
+        self.lock = threading.Lock()
+        self.reset()
+    def reset(self):
+        """Clear all of the counters"""
+        with self.lock:
+            self.stages = {}
+            self.events = []
+            self.t0 = time.perf_counter()
+            self.kernel0 = _perlin.counters()
+    def stage(self, name, frames=0, read=0, written=0, allocated=0):
+        """Time a stage, as a context manager.
+
+        Parameters
+        ----------
+        name : str
+            The name of the stage
+        frames : int
+            The number of frames processed
+        read, written, allocated : int
+            The number of bytes read (e.g. from the cache), written (e.g. to
+            the cache or the encoder) and allocated
+        """
+        if not self.enabled:
+            return _NULL
+        return self._stage(name, frames, read, written, allocated)
+    @contextlib.contextmanager
+    def _stage(self, name, frames, read, written, allocated):
+        wall, cpu = time.perf_counter(), time.process_time()
+        try:
+            yield
+        finally:
+            dwall, dcpu = time.perf_counter() - wall, time.process_time() - cpu
+            with self.lock:
+                s = self.stages.setdefault(name, dict(calls=0, wall_s=0.0, cpu_s=0.0, frames=0,
+                                                      bytes_read=0, bytes_written=0, bytes_allocated=0))
+                s['calls'] += 1
+                s['wall_s'] += dwall
+                s['cpu_s'] += dcpu
+                s['frames'] += int(frames)
+                s['bytes_read'] += int(read)
+                s['bytes_written'] += int(written)
+                s['bytes_allocated'] += int(allocated)
+                self.events.append(dict(name=name, ph="X", pid=os.getpid(), tid=threading.get_ident(),
+                                        ts=(wall-self.t0)*1e6, dur=dwall*1e6,
+                                        args=dict(frames=int(frames), cpu_s=dcpu)))
+    def stats(self):
+        """The totals for each stage, and for the C kernel.
+
+        The "kernel" entry holds the counters of _perlin since the last
+        reset, which are always on.
+        """
+        with self.lock:
+            stages = {k: dict(v) for k,v in self.stages.items()}
+        now = _perlin.counters()
+        stages['kernel'] = {k: now[k] - self.kernel0[k] for k in now}
+        return stages
+    def write_trace(self, fn):
+        """Save the recorded events in the Chrome trace format.
+
+        The file can be viewed in chrome://tracing or https://ui.perfetto.dev.
+        """
+        with self.lock:
+            events = list(self.events)
+        with open(fn, "w") as f:
+            json.dump(dict(traceEvents=events, displayTimeUnit="ms"), f)
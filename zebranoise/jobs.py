@@ -0,0 +1,89 @@
+import asyncio
+import concurrent.futures
+import threading
+
+# The number of frames generated between checks for cancellation
+CHECK_FRAMES = 16
+
+class Cancelled(Exception):
+    """Raised by a job which was cancelled before it finished"""
+
+class Job:
+    """Run a long task, such as generating a stimulus, on a background thread.
+
+    The task runs on its own thread, and the _perlin kernels it calls
+    release the GIL, so the calling thread (e.g. a GUI event loop) is not
+    blocked.  The task reports its progress as it goes, and checks between
+    chunks of work whether it has been cancelled, in which case it stops
+    at the next check and raises Cancelled.
+
+    Wait for the result with result(), or await the job in a coroutine.
+    Cancelling the awaiting task also cancels the job.
+
+    Parameters
+    ----------
+    func : function
+        func(job) does the work and returns the result.  It should call
+        job.check() between chunks of work, and job.report(done, total) to
+        report progress.
+    progress : function, optional
+        progress(done, total) is called after each report.  It is called
+        from the job's thread, so in an asyncio program pass it on to the
+        event loop with loop.call_soon_threadsafe.
+    """
+    def __init__(self, func, progress=None):
+        self.func = func
+        self.callback = progress
+        self.future = concurrent.futures.Future()
+        self.cancel_requested = threading.Event()
+        self.progress = (0, None)
+        self.thread = threading.Thread(target=self._run, daemon=True)
+        self.thread.start()
+    def _run(self):
+        self.future.set_running_or_notify_cancel()
+        try:
+            self.future.set_result(self.func(self))
+        except BaseException as e:
+            self.future.set_exception(e)
+    def check(self):
+        """Raise Cancelled if the job has been cancelled"""
+        if self.cancel_requested.is_set():
+            raise Cancelled()
+    def report(self, done, total):
+        """Record that `done` of `total` units of work are finished"""
+        self.progress = (done, total)
+        if self.callback is not None:
+            self.callback(done, total)
+    def cancel(self):
+        """Ask the job to stop at its next check.  This does not wait for it."""
+        self.cancel_requested.set()
+    def cancelled(self):
+        """Whether the job stopped because it was cancelled"""
+        return self.future.done() and isinstance(self.future.exception(), Cancelled)
+    def done(self):
+        """Whether the job has finished, failed or been cancelled"""
+        return self.future.done()
+    def result(self, timeout=None):
+        """Wait for the job to finish and return its result.
+
+        Raises the job's exception if it failed, Cancelled if it was
+        cancelled, or concurrent.futures.TimeoutError after timeout seconds.
+        """
+        return self.future.result(timeout)
+    def __await__(self):
+        return self._wait().__await__()
+    async def _wait(self):
+        try:
+            return await asyncio.wrap_future(self.future)
+        except asyncio.CancelledError:
+            self.cancel()
+            raise
+
+class _NullJob:
+    """The job passed when running synchronously, which is never cancelled"""
+    def check(self):
+        pass
+    def report(self, done, total):
+        pass
+
+NULL_JOB = _NullJob()
@@ -0,0 +1,159 @@
+"""Multi-resolution noise generation, which is close to independent of the octave count.
+
+Each octave of the noise is smooth on the scale of its lattice, so there
+is no need to evaluate the low-frequency octaves at every pixel.  Here each
+octave is evaluated on a subsampled grid with at least `oversample`
+samples per lattice cell along each axis.  The octaves are summed from the
+coarsest up, interpolating the running sum linearly onto each finer grid
+as it is needed.
+
+Octaves which need the full grid are evaluated exactly as by
+_perlin.make_perlin, and summed in the same order, so if no octave can be
+subsampled the output is identical to it.  Otherwise the interpolation
+error is of order (1/oversample)^2 of the octave's amplitude, so the
+statistics of the noise and of filtered (e.g. "comb") stimuli are
+unchanged.
+
+The subsampled grids are fixed over the whole movie, so frames are the
+same however they are split into batches, or into regions of interest.
+"""
+import numpy as np
+
+from . import _perlin
+
+def _strides(step, freq, oversample):
+    """The power-of-two stride with at least oversample samples per lattice cell"""
+    if step <= 0:
+        return 1
+    s = 1
+    while 2*s*step*freq*oversample <= 1:
+        s *= 2
+    return s
+
+def _grid(n, stride):
+    """Indices of every stride-th sample, and the last one"""
+    idx = np.arange(0, n, stride)
+    if idx[-1] != n-1:
+        idx = np.append(idx, n-1)
+    return idx
+
+def _resample(arr, axis, src, dst):
+    """Linearly interpolate arr, sampled at indices src along axis, onto indices dst"""
+    if len(src) == 1:
+        return np.take(arr, np.zeros(len(dst), dtype=int), axis=axis)
+    i = np.clip(np.searchsorted(src, dst, side="right") - 1, 0, len(src)-2)
+    w = ((dst - src[i]) / (src[i+1] - src[i])).astype("float32")
+    shape = [1]*arr.ndim
+    shape[axis] = len(dst)
+    lo = np.take(arr, i, axis=axis)
+    hi = np.take(arr, i+1, axis=axis)
+    hi -= lo
+    hi *= w.reshape(shape)
+    lo += hi
+    return lo
+
+class MultiresStream:
+    """A drop-in replacement for _perlin.PerlinStream using multi-resolution synthesis.
+
+    Takes the same arguments as PerlinStream, plus
+
+    Parameters
+    ----------
+    oversample : float > 0
+        The minimum number of samples per lattice cell along each axis for
+        an octave to be evaluated on a coarser grid.  Larger values are
+        more accurate and slower.
+    roi : (int, int, int, int), optional
+        Only generate the region of interest (x0, y0, width, height) of the
+        frames, which is identical to that part of the full frames.  x and
+        y are still the axes of the full frames.
+    """
+    def __init__(self, x, y, z, octaves=1, persistence=.5, lacunarity=2.0, repeatx=1024, repeaty=1024, repeatz=1024, base=0, threads=0, oversample=16, roi=None):
+        assert oversample > 0
+        self.axes = [np.asarray(a, dtype="float32") for a in (x, y, z)]
+        self.roi = (0, 0, len(self.axes[0]), len(self.axes[1])) if roi is None else tuple(roi)
+        x0, y0, w, h = self.roi
+        assert x0 >= 0 and y0 >= 0 and w > 0 and h > 0 and x0+w <= len(self.axes[0]) and y0+h <= len(self.axes[1])
+        self.repeats = (repeatx, repeaty, repeatz)
+        self.base = base
+        self.threads = threads
+        self.octaves = octaves
+        # Same octave schedule and amplitudes as lattice_build in _perlin.c
+        persistence, lacunarity = np.float32(persistence), np.float32(lacunarity)
+        self.freqs, self.amps = [], []
+        freq, amp = np.float32(1), np.float32(1)
+        for l in range(0, octaves):
+            self.freqs.append(freq)
+            self.amps.append(amp)
+            freq = np.float32(freq*lacunarity)
+            amp = np.float32(amp*persistence)
+            if float(amp) < .004:
+                break
+        self.max = np.float32(0)
+        for a in self.amps:
+            self.max = np.float32(self.max + a)
+        steps = [float(a[1]-a[0]) if len(a) > 1 else 0 for a in self.axes]
+        self.strides = [tuple(_strides(st, f, oversample) for st in steps) for f in self.freqs]
+    def __len__(self):
+        return len(self.axes[2])
+    def __iter__(self):
+        for t in range(0, len(self)):
+            yield self.frames(t)[0]
+    def _octave(self, l, idx):
+        """Octave l, without its amplitude, at the grid indices idx, as (z,y,x)"""
+        f = self.freqs[l]
+        xs, ys, zs = (np.asarray(a[i]*f, dtype="float32") for a,i in zip(self.axes, idx))
+        rx, ry, rz = (int(np.float32(r)*f) for r in self.repeats)
+        return _perlin.make_perlin(xs, ys, zs, octaves=1, repeatx=rx, repeaty=ry, repeatz=rz,
+                                   base=self.base, threads=self.threads, layout="zyx")
+    def _noise(self, start, stop):
+        """Frames start to stop-1 of the raw noise, as float32 (t,y,x)"""
+        n = [len(self.axes[0]), len(self.axes[1]), len(self.axes[2])]
+        x0, y0, w, h = self.roi
+        full = [np.arange(x0, x0+w), np.arange(y0, y0+h), np.arange(start, stop)]
+        if self.octaves == 1:
+            return self._octave(0, full)
+        def grid(strides):
+            idx = [_grid(n[d], strides[d]) for d in range(0, 3)]
+            # Only the part of each grid around this batch and region.  One
+            # more point is kept at the end, so that samples on a grid point
+            # are at the start of their interval in _resample, as they are
+            # in the full grid.
+            for d in range(0, 3):
+                lo = np.searchsorted(idx[d], full[d][0], side="right") - 1
+                hi = np.searchsorted(idx[d], full[d][-1], side="left")
+                idx[d] = idx[d][lo:hi+2]
+            return idx
+        acc, cur = None, None
+        for l in range(0, len(self.amps)):
+            idx = grid(self.strides[l])
+            if acc is not None:
+                acc = self._upsample(acc, cur, idx)
+            v = self._octave(l, idx)
+            v *= self.amps[l]
+            acc = v if acc is None else np.add(acc, v, out=acc)
+            cur = idx
+        acc = self._upsample(acc, cur, full)
+        acc /= self.max
+        return acc
+    @staticmethod
+    def _upsample(acc, src, dst):
+        # acc is (z,y,x) and the index lists are (x,y,z)
+        for d, axis in [(2, 0), (1, 1), (0, 2)]:
+            if not np.array_equal(src[d], dst[d]):
+                acc = _resample(acc, axis, src[d], dst[d])
+        return acc
+    def frames(self, start, stop=None, out=None, filters=None, norm=None):
+        """Generate frames start to stop-1, as for PerlinStream.frames"""
+        stop = start+1 if stop is None else stop
+        if start < 0 or stop > len(self) or start >= stop:
+            raise IndexError("Frame range out of bounds")
+        frames = self._noise(start, stop)
+        if out is None and filters is None and norm is None:
+            return np.ascontiguousarray(frames)
+        if out is not None and out.dtype == np.float32 and not filters and norm is None:
+            out[...] = frames
+            return out
+        if out is None:
+            out = np.empty(frames.shape, dtype="float32")
+        return _perlin.postprocess(frames, filters=filters, norm=norm, out=out, threads=self.threads)
@@ -1,15 +1,21 @@
 import hashlib
+import json
 import os
 import warnings
-import tempfile
-from subprocess import call
 from pathlib import Path
 import numpy as np
-import imageio
-from imageio_ffmpeg import get_ffmpeg_exe
 
 from . import _perlin
-from .util import generate_frames, filter_frames, filter_frames_index_function, XYSCALEBASE, discretize, apply_filters
+from .video import VideoWriter, video_filename
+from .pipeline import run_pipeline
+from .cache import FrameCache, Manifest, quantise
+from .stats import StreamingStats
+from .server import FrameServer
+from .realtime import RealtimeRenderer
+from .instrument import Instrumentation
+from .jobs import Job, Cancelled, NULL_JOB, CHECK_FRAMES
+from .playback import playback_plan, render_plan, write_grey
+from .util import frame_stream, generate_frames_batch, common_prefix, XYSCALEBASE, discretize, apply_filters, can_fuse, available_memory, split_overlays, apply_overlays
 
 
 class PerlinStimulus:
@@ -24,7 +30,7 @@ class PerlinStimulus:
     generate Perlin noise which you can save, filter, etc.
 
     """
-    def __init__(self, xsize, ysize, tdur, levels=10, xyscale=.2, tscale=50, fps=30, xscale=1.0, yscale=1.0, seed=0, demean="both", cachedir="perlcache", delay_batch=False):
+    def __init__(self, xsize, ysize, tdur, levels=10, xyscale=.2, tscale=50, fps=30, xscale=1.0, yscale=1.0, seed=0, demean="both", cachedir="perlcache", delay_batch=False, cache_dtype="float16", instrument=False, batch_memory=None, method="exact"):
         """Initialise Perlin noise stimulus.
 
         Parameters
@@ -53,6 +59,24 @@ class PerlinStimulus:
             A file path to the cache directory.  Will contain large files.
         delay_batch : bool
             If true, do not immediately generate perlin noise.  Manually call self.generate_batch() instead.
+        cache_dtype : {'float16', 'float32', 'uint16', 'uint8'}, default: 'float16'
+            How to store the noise in the cache.  The integer types store it
+            normalised by its min and max, and uint8 is only precise enough
+            for thresholded stimuli.
+        instrument : bool
+            If true, time each stage of generating and saving the stimulus.
+            See self.stats() and self.write_trace().
+        batch_memory : int > 0 or None
+            The memory to use for the frames being processed at once, in
+            bytes.  By default, a quarter of the memory currently available.
+        method : {'exact', 'multires', 'incremental', 'fixed'}, default: 'exact'
+            How to generate the noise.  'multires' evaluates the coarse
+            octaves on coarser grids, which is faster with many octaves and
+            statistically equivalent.  See zebranoise.multires.
+            'incremental' reuses the slowly changing octaves from frame to
+            frame, which is exact up to float rounding.  'fixed' computes
+            the noise in 16-bit fixed point, which is faster for large
+            frames and within 1.4e-3 of 'exact'.  See frame_stream.
 
         Notes
         -----
@@ -61,6 +85,7 @@ class PerlinStimulus:
 
         """
         assert demean in ["both", "time", "space", "none"]
+        assert method in ["exact", "multires", "incremental", "fixed"]
         tsize = int(tdur*fps)
         tscale = tscale
         self.ratio = xsize/ysize*XYSCALEBASE
@@ -76,40 +101,75 @@ class PerlinStimulus:
         self.seed = seed
         self.cachedir = Path(cachedir)
         self.cachedir.mkdir(exist_ok=True)
-        self.tmpdir = Path(tempfile.mkdtemp())
         self.xyscale = xyscale
         self.tscale = tscale
         self.levels = levels
         self.demean = demean
         self.xscale = xscale
         self.yscale = yscale
-        self.batch_size = int(400000000/(self.size[0]*self.size[1]))
-        #self.batch_size = int(400000/(self.size[0]*self.size[1]))
+        self.cache_dtype = cache_dtype
+        self.method = method
+        if batch_memory is None:
+            batch_memory = (available_memory() or 2**33)//4
+        # Each pixel of a batch takes a float32 while generating, and up to
+        # another float32 of temporaries while filtering.
+        self.batch_size = max(2, int(batch_memory/(8*self.size[0]*self.size[1])))
         if self.batch_size % 2 == 1: # Make sure it is an even number
-            self.batch_size += 1
+            self.batch_size -= 1
+        self._stream = None
+        self.instrumentation = Instrumentation(instrument)
         if not delay_batch:
             self.generate_batch()
-    def cache_filename(self, batch=None):
-        """Return the filename for the cache.
+    def stream(self):
+        """Return the _perlin.PerlinStream which generates the raw noise.
 
-        The cache is split up into different batches, saved in different files
+        The stream is created the first time this is called.
+        """
+        if self._stream is None:
+            self._stream = frame_stream(self.size[0], self.size[1], self.size[2], levels=self.levels,
+                                        xyscale=self.xyscale, tscale=self.tscale, xscale=self.xscale,
+                                        yscale=self.yscale, fps=self.fps, seed=self.seed, method=self.method)
+        return self._stream
+    def stats(self):
+        """Return per-stage timings and counters.
 
-        Parameters
-        ----------
-        batch : int, 'stats', or None
-            The ID of the batch to find.
+        Stages are only timed if the stimulus was created with
+        instrument=True, but the counters of the C kernel are always
+        included, under "kernel".  See zebranoise.instrument.
+        """
+        return self.instrumentation.stats()
+    def write_trace(self, fn):
+        """Save the timed stages as a Chrome trace file, see stats()."""
+        self.instrumentation.write_trace(fn)
+    def cache_filename(self):
+        """Return the filename for the cache.
+
+        All frames are saved in a single file, see zebranoise.cache.FrameCache.
 
         Returns
         -------
         str
             The filename of the cache
         """
-        h = hashlib.md5(str((self.size, self.fps, self.seed, self.xyscale, self.tscale, self.levels, self.demean)).encode()).hexdigest()
-        if batch is None:
-            return str(self.cachedir.joinpath(f"perlcache_{h}.npy"))
-        if batch == "stats":
-            return str(self.cachedir.joinpath(f"perlcache_{h}_stats.npz"))
-        return str(self.cachedir.joinpath(f"perlcache_{h}_{batch}.npy"))
+        return str(self.cachedir.joinpath(f"perlcache_{self.cache_key()}.zcache"))
+    def cache_key(self):
+        """A hash of all of the parameters which determine the cached noise"""
+        params = dict(self._frame_params(), nframes=self.size[2], demean=self.demean, cache_dtype=self.cache_dtype)
+        return hashlib.md5(json.dumps(params, sort_keys=True).encode()).hexdigest()
+    def _frame_params(self):
+        """The parameters which determine the generated frames, apart from their number.
+
+        Caches of stimuli with the same frame parameters share their first
+        frames, see common_prefix.
+        """
+        return dict(xsize=self.size[0], ysize=self.size[1], fps=self.fps, seed=self.seed, xyscale=self.xyscale,
+                    tscale=self.tscale, levels=self.levels, xscale=self.xscale, yscale=self.yscale,
+                    demean_time=self.demean in ["both", "time"], method=self.method, dtype=self._staging_dtype())
+    def cache(self):
+        """Open the cache for reading, generating it first if necessary."""
+        if not hasattr(self, "min_"):
+            self.generate_batch()
+        return FrameCache(self.cache_filename())
     def generate_frame(self, t=0, filters=[]):
         """Generate and return a single image of noise.
 
@@ -128,99 +188,304 @@ class PerlinStimulus:
         2-dimensional ndarray
             An image of the noise
         """
-        arr = generate_frames(self.size[0], self.size[1], self.size[2], timepoints=[t] if not hasattr(t, "__iter__") else t, levels=self.levels,
-                              xyscale=self.xyscale, tscale=self.tscale, xscale=self.xscale,
-                              yscale=self.yscale, fps=self.fps, seed=self.seed)
+        timepoints = [t] if not hasattr(t, "__iter__") else t
+        arr = np.concatenate([self.stream().frames(i) for i in timepoints]).transpose([1,2,0])
         if self.demean in ["both", "time"]:
             arr -= np.mean(arr, axis=(0,1), keepdims=True)
         arr = apply_filters(arr, filters)
         return arr.squeeze()
 
-    def generate_batch(self):
+    def generate_batch(self, job=None):
         """Create the stimulus
 
         Runs the _perlin C module and saves the output in batches.
 
         If this function has already been run before and has been cached on the
         filesytem, automatically load the statistics from it.  Otherwise,
-        generate the stimuli and cache them.
+        generate the stimuli and cache them.  If a previous run was
+        interrupted, only the missing batches are generated, see
+        zebranoise.cache.Manifest.  If the cache of a stimulus which only
+        differs in duration exists, the frames they have in common are
+        copied from it.
+
+        To spread the work over several processes or machines, use
+        generate_shard and merge_shards instead.  To run in the
+        background, use generate_async.
+
+        Parameters
+        ----------
+        job : zebranoise.jobs.Job, optional
+            The job this runs in, which receives the progress in frames
+            and is checked for cancellation every few frames
         """
         # If the cache already exists, load the statistics (used for
         # normalisation) and exit immediately.
-        if os.path.isfile(self.cache_filename("stats")):
-            stats = np.load(self.cache_filename("stats"))
-            self.min_ = stats['min_']
-            self.max_ = stats['max_']
-            self.nframes = stats['nframes']
+        if self._load_stats():
             return
-        # Generate the stimuli and save the means and mins/maxes.  If we are
-        # demeaning across space, we won't end up using the mins or maxes saved
-        # here.
-        means_t = []
-        means_xy = []
-        weights = []
-        mins = []
-        maxes = []
-        for k in range(0, int(np.ceil(self.size[2]/self.batch_size))):
-            print(f"Generating batch {k}")
-            arr = generate_frames(self.size[0], self.size[1], tsize=self.size[2],
-                                  timepoints=list(range(k*self.batch_size,min(self.size[2],(k+1)*self.batch_size))),
-                                  levels=self.levels, xyscale=self.xyscale, tscale=self.tscale, xscale=self.xscale,
-                                  yscale=self.yscale, fps=self.fps, seed=self.seed)
-            if self.demean in ["both", "time"]:
-                arr -= np.mean(arr, axis=(0,1), keepdims=True)
-            mins.append(np.min(arr))
-            maxes.append(np.max(arr))
-            means_t.append(np.mean(arr, axis=2))
-            weights.append(arr.shape[2])
-            np.save(self.cache_filename(k), arr.astype("float16"))
-            del arr
-        # Compute the spatial mean (across t)
-        mean_t = np.sum(means_t*(np.asarray(weights)[:,None,None]), axis=0)/np.sum(weights)
-        nframes = np.sum(weights)
-        # Optionally remove the spatial mean.  If so, iterate through and
-        # update all of the saved data files to remove the spatial mean.
-        if self.demean in ["both", "space"]:
-            k = 0
-            mins = []
-            maxes = []
-            while os.path.isfile(self.cache_filename(k)):
-                arr = np.load(self.cache_filename(k)).astype("float32")
-                arr -= mean_t[:,:,None]
-                mins.append(np.min(arr))
-                maxes.append(np.max(arr))
-                np.save(self.cache_filename(k), arr.astype("float16"))
-                del arr
-                k += 1
-        min_ = np.min(mins)
-        max_ = np.max(maxes)
+        cache, stats, manifest = self._open_staging()
+        for start, stop in manifest.missing():
+            self._generate_range(cache, start, stop, stats, job, manifest)
+        self._finish_cache(cache, stats)
+    def generate_async(self, progress=None):
+        """Run generate_batch on a background thread.
+
+        Returns a zebranoise.jobs.Job, which can be awaited or cancelled.
+        A cancelled job can be resumed later by calling generate_batch or
+        generate_async again.
+
+        Parameters
+        ----------
+        progress : function, optional
+            progress(done, total) is called with the number of frames
+            generated, from the job's thread
+        """
+        return Job(lambda job : self.generate_batch(job=job), progress=progress)
+    def shard_range(self, shard, nshards):
+        """The frames (start, stop) generated by shard number `shard` of `nshards`"""
+        assert 0 <= shard < nshards, "Invalid shard"
+        return (shard*self.size[2]//nshards, (shard+1)*self.size[2]//nshards)
+    def shard_filename(self, shard, nshards):
+        """The file holding the statistics of a finished shard"""
+        return f"{self.cache_filename()}.shard{shard}of{nshards}.npz"
+    def generate_shard(self, shard, nshards):
+        """Generate one part of the cache, e.g. as one job on a cluster.
+
+        The frames are split into `nshards` contiguous ranges.  Each shard
+        writes its frames into the shared cache file in `cachedir`, which
+        must be on a filesystem all of the shards can see, and saves the
+        statistics of its frames to shard_filename.  Shards may run in any
+        order and at the same time.  Once all of them have finished, call
+        merge_shards to combine the statistics and finish the cache.
+
+        A shard which has already finished is not generated again, so
+        failed jobs can simply be resubmitted.
+
+        Parameters
+        ----------
+        shard : int
+            The number of this shard, from 0 to nshards-1
+        nshards : int
+            The total number of shards
+        """
+        start, stop = self.shard_range(shard, nshards)
+        statsfn = self.shard_filename(shard, nshards)
+        if self._load_stats() or os.path.isfile(statsfn):
+            return
+        demean_space = self.demean in ["both", "space"]
+        cache = FrameCache.open_or_create(self._staging_filename(), (self.size[2], self.size[1], self.size[0]),
+                                          dtype=self._staging_dtype(), key=self.cache_key(), mean=demean_space)
+        stats = StreamingStats((self.size[1], self.size[0]))
+        self._generate_range(cache, start, stop, stats)
+        cache.close()
+        # Written under another name first, so a shard which is killed part
+        # way through is never counted as finished.
+        tmpfn = statsfn[:-len(".npz")] + ".tmp.npz"
+        stats.save(tmpfn)
+        os.replace(tmpfn, statsfn)
+    def merge_shards(self, nshards):
+        """Finish a cache generated with generate_shard.
+
+        Combines the statistics of all shards, saves them in the cache and
+        marks it complete, quantising it first if necessary.  The shards'
+        statistics files are then removed.
+
+        Parameters
+        ----------
+        nshards : int
+            The total number of shards, as passed to generate_shard
+        """
+        if self._load_stats():
+            return
+        fns = [self.shard_filename(i, nshards) for i in range(0, nshards)]
+        missing = [i for i,fn in enumerate(fns) if not os.path.isfile(fn)]
+        if missing:
+            raise IOError(f"Shards {missing} of {nshards} have not finished")
+        stats = StreamingStats((self.size[1], self.size[0]))
+        for fn in fns:
+            stats.merge(StreamingStats.load(fn))
+        assert stats.count == self.size[2], "Shards do not cover the whole stimulus"
+        self._finish_cache(FrameCache(self._staging_filename(), mode="r+"), stats)
+        for fn in fns:
+            os.unlink(fn)
+    def _quantise_dtype(self):
+        """The integer dtype of the cache, or None if it holds floats"""
+        return self.cache_dtype if self.cache_dtype in ["uint8", "uint16"] else None
+    def _staging_dtype(self):
+        # Integer caches are quantised using the final min and max, so they
+        # are generated as float16 first and converted at the end.
+        return "float16" if self._quantise_dtype() else self.cache_dtype
+    def _staging_filename(self):
+        """The file the frames are generated into"""
+        fn = self.cache_filename()
+        return fn + ".tmp" if self._quantise_dtype() else fn
+    def _create_cache(self):
+        """Create a new cache to generate the frames into"""
+        demean_space = self.demean in ["both", "space"]
+        return FrameCache.create(self._staging_filename(), (self.size[2], self.size[1], self.size[0]),
+                                 dtype=self._staging_dtype(), key=self.cache_key(), mean=demean_space)
+    def _manifest_filename(self):
+        """The record of the batches generated so far, see zebranoise.cache.Manifest"""
+        return f"{self.cache_filename()}.manifest.json"
+    def _open_staging(self):
+        """Open the cache to generate frames into, resuming an interrupted generate_batch.
+
+        Returns the cache, the StreamingStats of the frames it already
+        holds, and its Manifest.
+        """
+        stats = StreamingStats((self.size[1], self.size[0]))
+        manifest = Manifest.load(self._manifest_filename())
+        cache = None
+        if manifest is not None and manifest.key == self.cache_key() and os.path.isfile(self._staging_filename()):
+            cache = FrameCache(self._staging_filename(), mode="r+")
+            if cache.complete or cache.header['key'] != self.cache_key():
+                cache.close()
+                cache = None
+        if cache is None:
+            cache = self._create_cache()
+            manifest = Manifest(self._manifest_filename(), self.cache_key(), self._frame_params(), self.size[2],
+                                os.path.basename(self._staging_filename()))
+            self._copy_prefix(cache, stats, manifest)
+        else:
+            # Only keep the batches which reached the disk intact
+            manifest.verify(cache)
+            for start, stop, _ in manifest.batches:
+                stats.update(cache.read(start, stop, demean=False))
+            print(f"Resuming with {sum(b[1]-b[0] for b in manifest.batches)} of {self.size[2]} frames")
+        manifest.save()
+        return cache, stats, manifest
+    def _copy_prefix(self, cache, stats, manifest):
+        """Copy the first frames from the cache of a stimulus which only differs in duration"""
+        if self.method != "exact":
+            return
+        best, nbest = None, 0
+        for fn in self.cachedir.glob("perlcache_*.manifest.json"):
+            other = Manifest.load(fn)
+            if other is None or other.key == manifest.key or other.params != manifest.params:
+                continue
+            n = min(other.prefix(), common_prefix(self.size[2], other.nframes, self.levels, self.xyscale, self.tscale, self.fps))
+            if n > nbest and os.path.isfile(other.cache_path()):
+                best, nbest = other, n
+        if best is None:
+            return
+        source = FrameCache(best.cache_path())
+        best.verify(source)
+        nbest = min(nbest, best.prefix())
+        if nbest > 0:
+            print(f"Copying {nbest} frames from {best.cache_path()}")
+        for start in range(0, nbest, self.batch_size):
+            stop = min(nbest, start+self.batch_size)
+            cache.frames[start:stop] = source.frames[start:stop]
+            stats.update(cache.read(start, stop, demean=False))
+            manifest.add(start, stop, cache.checksum(start, stop))
+        source.close()
+        cache.flush()
+    def _load_stats(self):
+        """Load the statistics from a finished cache, returning whether it exists"""
+        fn = self.cache_filename()
+        if not os.path.isfile(fn):
+            return False
+        cache = FrameCache(fn)
+        try:
+            if not (cache.complete and cache.header['key'] == self.cache_key()):
+                return False
+            self.min_ = cache.stats['min_']
+            self.max_ = cache.stats['max_']
+            self.nframes = int(cache.stats['nframes'])
+            return True
+        finally:
+            cache.close()
+    def _generate_range(self, cache, start, stop, stats, job=None, manifest=None):
+        """Generate frames start to stop into the cache, adding them to stats"""
+        def render(bstart, bstop, out):
+            self.stream().frames(bstart, bstop, out=out[0])
+        _generate_ranges([self], [cache], start, stop, render, self.batch_size, [stats], job,
+                         None if manifest is None else [manifest])
+    def _finish_cache(self, cache, stats):
+        """Save the statistics of all frames in the cache and mark it complete"""
+        if cache.mean is not None:
+            cache.mean[:] = stats.mean()
+            min_, max_ = stats.bounds(cache.mean)
+        else:
+            min_, max_ = stats.bounds()
+        nframes = stats.count
         # Save the mins and maxes.
-        np.savez_compressed(self.cache_filename("stats"), min_=min_, max_=max_, nframes=nframes)
+        cache.set_stats(min_=min_, max_=max_, nframes=nframes)
+        quantise_to = self._quantise_dtype()
+        if quantise_to:
+            with self.instrumentation.stage("quantise", frames=self.size[2], read=cache.frames.nbytes):
+                final = quantise(cache, self.cache_filename(), quantise_to, *stats.bounds())
+            cache.close()
+            os.unlink(self._staging_filename())
+            # The frames it describes have been deleted
+            if os.path.isfile(self._manifest_filename()):
+                os.unlink(self._manifest_filename())
+            cache = final
+        cache.flush()
+        cache.set_stats(complete=True)
+        cache.close()
         self.min_ = min_
         self.max_ = max_
         self.nframes = nframes
-    def save_grey_pad(self, fn, dur, bitrate=20):
-        """Create a grey screen video which can be used to pad"""
-        one_frame = np.load(self.cache_filename(0), mmap_mode='r')[:,:,0].astype('uint8') * 0 + 127
-        imageio.imsave(self.tmpdir.joinpath("_grey.tif"), one_frame, format="pillow", compression="tiff_adobe_deflate")
-        n_frames = int(dur * self.fps)
-        for i in range(0, n_frames):
-            os.link(self.tmpdir.joinpath("_grey.tif"), self.tmpdir.joinpath(f"_frame{i:05}.tif"))
-        if fn[-4:] != ".mp4":
-            fn += ".mp4"
-        call([get_ffmpeg_exe(), "-r", str(self.fps), "-i", str(self.tmpdir.joinpath("_frame%5d.tif")), "-c:v", "mpeg2video", "-an", "-b:v", f"{bitrate}M", fn])
-        for p in self.tmpdir.glob("_frame*.tif"):
-            p.unlink()
-        self.tmpdir.joinpath("_grey.tif").unlink()
-    def save_video(self, fn, loop=1, filters=[], bitrate=20):
+    def frame_server(self, filters=[], lru_size=16):
+        """Return a FrameServer giving random access to single filtered frames.
+
+        See zebranoise.server.FrameServer.  This does not generate the cache,
+        but uses it if it exists.
+        """
+        return FrameServer(self, filters=filters, lru_size=lru_size)
+    def realtime(self, filters=[], prefetch=8, loop=False):
+        """Return a RealtimeRenderer presenting the filtered stimulus at its fps.
+
+        Frames are rendered as they are needed, from the cache if it has been
+        generated, rather than encoded to a video first.  See
+        zebranoise.realtime.RealtimeRenderer and frame_server.  Stopping the
+        renderer closes its frame server.
+        """
+        server = self.frame_server(filters=filters, lru_size=0)
+        def render(t, out):
+            out[...] = server.get(t)
+        return RealtimeRenderer(render, self.size[2], (self.size[1], self.size[0]), self.fps, prefetch=prefetch, loop=loop,
+                                close=server.close)
+    def save_grey_pad(self, fn, dur, bitrate=20, codec="mpeg2", threads=0):
+        """Create a grey screen video which can be used to pad.
+
+        codec and threads are as for save_video, and should match the
+        video being padded.
+        """
+        fn = video_filename(fn, codec)
+        with VideoWriter(fn, self.size[0], self.size[1], self.fps, bitrate, codec=codec, threads=threads) as writer:
+            write_grey(writer, int(dur * self.fps))
+    def _filter_batch(self, data, filters, shift, norm=None):
+        """Normalise, filter and discretize a cached batch in Python.
+
+        `data` is in (y,x,t) order and `shift` is the index of its first
+        frame in the movie.  `norm` is the (min, max) to normalise by,
+        defaulting to that of the whole stimulus.  Overlay filters after
+        all of the others are drawn on the discretized frames, see
+        split_overlays.
+        """
+        filters, overlays = split_overlays(filters)
+        min_, max_ = (self.min_, self.max_) if norm is None else norm
+        data = data.astype("float32")
+        # Renormalise using precomputed mins/maxes
+        data -= min_
+        data *= 1/(max_-min_)
+        data = discretize(apply_filters(data, filters, shift))
+        apply_overlays(np.moveaxis(data, 2, 0), overlays, shift)
+        return data
+    def save_video(self, fn, loop=1, filters=[], bitrate=20, queue_depth=1, workers=1, job=None, codec="mpeg2", threads=0, pad=0):
         """Save the filtered stimulus.
 
         Parameters
         ----------
         fn : str
-            The file name to save the video
+            The file name to save the video.  The extension of the codec's
+            container (e.g. .mp4) is added if it is missing.  If it ends in
+            .ffconcat, the video is saved as a playlist, see
+            zebranoise.playback.render_plan.
         loop : int > 0
-            The number of times the stimulus should loop in the saved video
+            The number of times the stimulus should loop in the saved video.
+            The stimulus is only encoded once however many times it loops.
         filters : list of str and/or (str, ...) tuples
             A list of filters to apply to the stimulus.  If a filter requires
             parameters, pass a tuple, where the first element is the name of
@@ -229,50 +494,205 @@ class PerlinStimulus:
             The bitrate in megabits per second.  The default is good for binary
             videos and pure noise, but a higher value may be necessary if
             using the "wood" filter.
+        queue_depth : int > 0
+            The number of batches which may wait between the filter and
+            encode stages.  Each waiting batch is held in memory.
+        workers : int > 0
+            The number of threads filtering batches.
+        job : zebranoise.jobs.Job, optional
+            The job this runs in.  It receives the progress of generating
+            the cache, if necessary, and then of encoding, in frames, and
+            is checked for cancellation before each batch.  A cancelled
+            video is deleted.
+        codec : str
+            The encoder to use, see zebranoise.video.CODECS.  The default,
+            "mpeg2", is the most widely supported.  "h264_nvenc",
+            "h264_qsv" or "h264_vaapi" encode on the GPU, and are much
+            faster if available.  "ffv1" and "x264_lossless" are lossless,
+            so edges of binary stimuli are kept exactly.
+        threads : int >= 0
+            The number of encoder threads, or 0 for ffmpeg's default
+        pad : float >= 0
+            The duration in seconds of grey screen to show after each loop
         """
         if Path(fn).exists():
             raise IOError("Output video file already exists!")
-        i = 0
-        k = 0
-        shift = 0
-        filtind = filter_frames_index_function(filters, nframes=self.nframes)
-        while os.path.isfile(self.cache_filename(k)):
-            data = np.load(self.cache_filename(k)).astype("float32")
-            # Renormalise using precomputed mins/maxes
-            data -= self.min_
-            data *= 1/(self.max_-self.min_)
-            # Apply filters
-            for f in filters:
-                if isinstance(f, str):
-                    n = f
-                    if n=="photodiode_ibl":
-                        np.random.seed(1234)
-                        seq = np.tile(np.random.random(3600), (8,1)).T.flatten()
-                        args = (seq[shift:(shift+data.shape[2])] > .5).astype(np.int8)
-                    else:
-                        args = []
+        if not fn.endswith(".ffconcat"):
+            fn = video_filename(fn, codec)
+        job = NULL_JOB if job is None else job
+        if not hasattr(self, "min_"):
+            self.generate_batch(job=job)
+        # Each distinct segment of the video is encoded once, streaming
+        # frames straight to the encoder in playback order, so reversing
+        # reads the cache backwards.  The cache is memory mapped, so each
+        # batch is read from the file only by the filtering stage.
+        plan = playback_plan(self.size[2], loop, "reverse" in filters, int(pad*self.fps))
+        total = sum(seg.stop-seg.start for seg in dict.fromkeys(plan))
+        # Markers are drawn into the uint8 frames after filtering
+        noise_filters, overlays = split_overlays(filters)
+        fused = can_fuse(noise_filters, postprocess=True)
+        cache = self.cache()
+        ins = self.instrumentation
+        encoded = [0]
+        def postprocess(span):
+            job.check()
+            start, stop, reverse = span
+            with ins.stage("filter", frames=stop-start, read=cache.frames[start:stop].nbytes,
+                           allocated=(stop-start)*self.size[0]*self.size[1]):
+                if fused:
+                    # Renormalise, filter and discretize in a single pass in C
+                    frames = _perlin.postprocess(cache.frames[start:stop], filters=noise_filters, norm=cache.raw_range(self.min_, self.max_), mean=cache.raw_mean())
+                    apply_overlays(frames, overlays, start)
                 else:
-                    n = f[0]
-                    if n=="photodiode_ibl":
-                        #print(data.shape[2])
-                        args = f[1][shift:(shift+data.shape[2])].astype(np.int8)
-                    else:
-                        args = f[1:]
-                data = filter_frames(data, n,*args)
-            data = discretize(data)
-            assert data.dtype == 'uint8'
-            for j in range(0, data.shape[2]):
-                imageio.imsave(self.tmpdir.joinpath(f"_frame{filtind(i):05}.tif"), data[:,:,j], format="pillow", compression="tiff_adobe_deflate")
-                i += 1
-            k += 1
-            shift += data.shape[2]
-            del data
-        n_frames = i
-        for j in range(1, loop):
-            for i in range(0, n_frames):
-                os.link(self.tmpdir.joinpath(f"_frame{i:05}.tif"), self.tmpdir.joinpath(f"_frame{(i+j*n_frames):05}.tif"))
-        if fn[-4:] != ".mp4":
-            fn += ".mp4"
-        call([get_ffmpeg_exe(), "-r", str(self.fps), "-i", str(self.tmpdir.joinpath("_frame%5d.tif")), "-c:v", "mpeg2video", "-an", "-b:v", f"{bitrate}M", fn])
-        for p in self.tmpdir.glob("_frame*.tif"):
-            p.unlink()
+                    data = self._filter_batch(np.moveaxis(cache.read(start, stop), 0, 2), filters, start)
+                    assert data.dtype == 'uint8'
+                    frames = np.moveaxis(data, 2, 0)
+            return frames[::-1] if reverse else frames
+        def encode_segment(seg, segfn):
+            def encode(frames):
+                with ins.stage("encode", frames=len(frames), written=frames.nbytes):
+                    writer.write(frames)
+                encoded[0] += len(frames)
+                job.report(encoded[0], total)
+            with VideoWriter(segfn, self.size[0], self.size[1], self.fps, bitrate, codec=codec, threads=threads) as writer:
+                if seg.kind == "grey":
+                    job.check()
+                    write_grey(writer, seg.stop-seg.start)
+                    encoded[0] += seg.stop-seg.start
+                    job.report(encoded[0], total)
+                    return
+                spans = [(start, min(seg.stop, start+self.batch_size), seg.reverse)
+                         for start in range(seg.start, seg.stop, self.batch_size)]
+                if seg.reverse:
+                    spans = spans[::-1]
+                # Filtering batch k overlaps with encoding batch k-1
+                run_pipeline(spans, [(postprocess, workers), encode], depth=queue_depth)
+        try:
+            render_plan(fn, plan, encode_segment, codec)
+        except Cancelled:
+            if os.path.isfile(fn):
+                os.unlink(fn)
+            raise
+        finally:
+            cache.close()
+    def save_video_async(self, fn, progress=None, **kwargs):
+        """Run save_video on a background thread.
+
+        Takes the same arguments as save_video, and returns a
+        zebranoise.jobs.Job which can be awaited or cancelled.  `progress`
+        is as for generate_async.
+        """
+        return Job(lambda job : self.save_video(fn, job=job, **kwargs), progress=progress)
+
+
+def _generate_ranges(stimuli, caches, start, stop, render, batch_size, stats, job=None, manifests=None):
+    """Generate frames start to stop of each stimulus into its cache.
+
+    render(bstart, bstop, out) writes frames bstart to bstop-1 of every
+    stimulus into the float32 array out, of shape (len(stimuli),
+    bstop-bstart, ysize, xsize).  The frames are added to the
+    StreamingStats of each stimulus in the list stats.  With a job, the
+    frames are rendered a few at a time, checking for cancellation in
+    between, and the number of frames done out of stop is reported.  If
+    given, each batch is recorded in the Manifest of each cache once it
+    has been written.
+    """
+    # Generate the stimuli in a single pass, keeping track of the
+    # per-pixel means, mins and maxes of the frames as they are stored, so
+    # they are the same however the cache was filled.  The spatial mean is
+    # not subtracted from the cached frames but saved alongside them, and the
+    # cache subtracts it when they are read.  Each pixel then has a
+    # constant subtracted, so the min and max after demeaning follow
+    # exactly from the per-pixel mins and maxes.
+    xsize, ysize = stimuli[0].size[0:2]
+    job = NULL_JOB if job is None else job
+    # All batches are generated into the same buffer, in the cache's
+    # (t,y,x) layout
+    ins = stimuli[0].instrumentation
+    nbuf = min(batch_size, stop-start)
+    buf = np.empty(len(stimuli)*nbuf*ysize*xsize, dtype="float32")
+    for k,bstart in enumerate(range(start, stop, batch_size)):
+        print(f"Generating batch {bstart//batch_size}")
+        bstop = min(stop, bstart+batch_size)
+        n = bstop - bstart
+        arrs = buf[0:len(stimuli)*n*ysize*xsize].reshape(len(stimuli), n, ysize, xsize)
+        with ins.stage("generate", frames=n*len(stimuli), allocated=buf.nbytes if k == 0 else 0):
+            step = n if job is NULL_JOB else CHECK_FRAMES
+            for cstart in range(bstart, bstop, step):
+                cstop = min(bstop, cstart+step)
+                job.check()
+                render(cstart, cstop, arrs[:,cstart-bstart:cstop-bstart])
+                job.report(cstop, stop)
+        for i,(s,cache,st,arr) in enumerate(zip(stimuli, caches, stats, arrs)):
+            if s.demean in ["both", "time"]:
+                arr -= np.mean(arr, axis=(1,2), keepdims=True)
+            with s.instrumentation.stage("cache_write", frames=n, written=cache.frames[bstart:bstop].nbytes):
+                cache.write(bstart, arr)
+            with s.instrumentation.stage("stats", frames=n):
+                st.update(cache.read(bstart, bstop, demean=False))
+            if manifests is not None:
+                cache.flush()
+                manifests[i].add(bstart, bstop, cache.checksum(bstart, bstop))
+                manifests[i].save()
+        del arrs, arr
+    for cache in caches:
+        cache.flush()
+
+def generate_stimuli(stimuli, job=None):
+    """Generate the caches of several stimuli together, in a single pass.
+
+    This is faster than calling generate_batch on each stimulus in turn
+    when they are variants of the same noise with different xyscales.
+    The stimuli, created with delay_batch=True, may differ in seed,
+    xyscale, demean, cachedir and cache_dtype, but must have the same
+    size, fps, tscale, levels, xscale and yscale, and use method='exact'.
+    Their noise is computed by generate_frames_batch, so stimuli with the
+    same seed share the work for each octave, but stimuli with different
+    seeds do not.  Each cache is identical to the one generate_batch would
+    create.  Stimuli whose caches already exist are skipped.
+
+    Stimuli which only differ in their filters need no batching, since the
+    filters are applied when reading from the same cache.
+
+    Parameters
+    ----------
+    stimuli : list of PerlinStimulus
+        The stimuli to generate
+    job : zebranoise.jobs.Job, optional
+        The job this runs in, as for PerlinStimulus.generate_batch.  A
+        cancelled batched generation starts again from the beginning.
+    """
+    todo = {}
+    for s in stimuli:
+        if not s._load_stats():
+            todo.setdefault(s.cache_filename(), s)
+    todo = list(todo.values())
+    if len(todo) == 0:
+        return
+    first = todo[0]
+    shared = lambda s : (s.size, s.fps, s.tscale, s.levels, s.xscale, s.yscale)
+    for s in todo:
+        assert shared(s) == shared(first), "Stimuli must only differ in seed, xyscale, demean and caching"
+        assert s.method == "exact", "Batched generation requires method='exact'"
+    # Every stimulus's frames are held at once
+    batch_size = max(2, min(s.batch_size for s in todo)//len(todo)//2*2)
+    xsize, ysize, tsize = first.size
+    def render(bstart, bstop, out):
+        # Chunks of a batch are not contiguous for several stimuli
+        frames = generate_frames_batch(xsize, ysize, tsize, np.arange(bstart, bstop), seeds=[s.seed for s in todo],
+                                       xyscales=[s.xyscale for s in todo], levels=first.levels, tscale=first.tscale,
+                                       xscale=first.xscale, yscale=first.yscale, fps=first.fps,
+                                       out=out if out.flags.c_contiguous else None)
+        if frames is not out:
+            out[...] = frames
+    caches = [s._create_cache() for s in todo]
+    manifests = [Manifest(s._manifest_filename(), s.cache_key(), s._frame_params(), tsize,
+                          os.path.basename(s._staging_filename())) for s in todo]
+    allstats = [StreamingStats((ysize, xsize)) for s in todo]
+    _generate_ranges(todo, caches, 0, tsize, render, batch_size, allstats, job, manifests)
+    for s,cache,stats in zip(todo, caches, allstats):
+        s._finish_cache(cache, stats)
+    # Duplicates of the stimuli just generated
+    for s in stimuli:
+        if not hasattr(s, "min_"):
+            s._load_stats()
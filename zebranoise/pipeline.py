@@ -0,0 +1,118 @@
+import queue
+import threading
+
+_DONE = object()
+
+def run_pipeline(items, stages, depth=2):
+    """Run each item through a chain of stages, with the stages overlapping.
+
+    Each stage runs on its own thread(s) and the stages are connected by
+    bounded queues, so while stage 2 processes item k, stage 1 can already
+    be working on item k+1 and stage 3 on item k-1.  This only helps if the
+    stages release the GIL, which the _perlin functions, numpy file IO and
+    writing to the ffmpeg pipe all do.
+
+    Parameters
+    ----------
+    items : iterable
+        The inputs to the first stage
+    stages : list of functions or (function, int) tuples
+        Each function takes the output of the previous stage and returns the
+        input to the next one.  Pass a tuple to run a stage on several
+        worker threads.  Stages with a single worker always see their
+        inputs in the order of `items`; stages with several workers may
+        process them in any order.
+    depth : int > 0
+        The maximum number of items waiting between two stages.  Together
+        with the number of workers, this bounds the number of items held in
+        memory at once.
+
+    Returns
+    -------
+    list
+        The outputs of the last stage, in the order of `items`
+
+    Notes
+    -----
+    If a stage raises an exception, all stages are stopped and the
+    exception is raised again here.
+    """
+    assert depth >= 1, "Queue depth must be at least 1"
+    stages = [s if isinstance(s, tuple) else (s, 1) for s in stages]
+    assert all(n >= 1 for _,n in stages), "Each stage needs at least one worker"
+    queues = [queue.Queue(maxsize=depth) for _ in range(0, len(stages)+1)]
+    abort = threading.Event()
+    errors = []
+    def put(q, item):
+        while not abort.is_set():
+            try:
+                q.put(item, timeout=.1)
+                return True
+            except queue.Full:
+                pass
+        return False
+    def get(q):
+        while not abort.is_set():
+            try:
+                return q.get(timeout=.1)
+            except queue.Empty:
+                pass
+        return _DONE
+    def worker(i, func, state):
+        qin, qout = queues[i], queues[i+1]
+        pending = {}
+        try:
+            while True:
+                item = get(qin)
+                if item is _DONE:
+                    break
+                if state["workers"] > 1:
+                    if not put(qout, (item[0], func(item[1]))):
+                        return
+                    continue
+                # Single workers process items in order, holding back any
+                # which overtook each other in a parallel stage upstream.
+                pending[item[0]] = item[1]
+                while state["next"] in pending:
+                    if not put(qout, (state["next"], func(pending.pop(state["next"])))):
+                        return
+                    state["next"] += 1
+        except BaseException as e:
+            errors.append(e)
+            abort.set()
+            return
+        # Let the other workers on this stage see the end of the input, and
+        # have the last one to finish pass it on to the next stage.
+        with state["lock"]:
+            state["running"] -= 1
+            put(qin if state["running"] > 0 else qout, _DONE)
+    threads = []
+    for i,(func,n) in enumerate(stages):
+        state = {"workers": n, "running": n, "next": 0, "lock": threading.Lock()}
+        threads += [threading.Thread(target=worker, args=(i, func, state), daemon=True) for _ in range(0, n)]
+    for t in threads:
+        t.start()
+    results = {}
+    def collect():
+        while True:
+            item = get(queues[-1])
+            if item is _DONE:
+                return
+            results[item[0]] = item[1]
+    collector = threading.Thread(target=collect, daemon=True)
+    collector.start()
+    try:
+        for j,item in enumerate(items):
+            if not put(queues[0], (j, item)):
+                break
+        put(queues[0], _DONE)
+        collector.join()
+    except BaseException:
+        abort.set()
+        raise
+    finally:
+        for t in threads:
+            t.join()
+    if errors:
+        raise errors[0]
+    return [results[j] for j in sorted(results)]
@@ -0,0 +1,120 @@
+import os
+import subprocess
+import tempfile
+from collections import namedtuple
+import numpy as np
+from imageio_ffmpeg import get_ffmpeg_exe
+
+from .video import CODECS
+
+Segment = namedtuple("Segment", ["kind", "start", "stop", "reverse"])
+Segment.__doc__ = """A run of frames in a video.
+
+kind is "stimulus" for frames start to stop-1 of the stimulus, played
+backwards if reverse is True, or "grey" for stop-start grey frames.
+"""
+
+GREY = 127
+
+def playback_plan(nframes, loop=1, reverse=False, pad=0):
+    """The segments of a video which plays a stimulus `loop` times.
+
+    Parameters
+    ----------
+    nframes : int > 0
+        The number of frames in the stimulus
+    loop : int > 0
+        The number of times to play it
+    reverse : bool
+        Play it backwards
+    pad : int >= 0
+        The number of grey frames to show after each repetition
+
+    Returns
+    -------
+    list of Segment
+        The segments in playback order.  Repeated segments are equal, so
+        they only need to be rendered once.
+    """
+    assert loop >= 1 and pad >= 0
+    plan = []
+    for i in range(0, loop):
+        plan.append(Segment("stimulus", 0, nframes, reverse))
+        if pad > 0:
+            plan.append(Segment("grey", 0, pad, False))
+    return plan
+
+def write_grey(writer, nframes, chunk=64):
+    """Write nframes grey frames to a VideoWriter"""
+    frames = np.full((min(nframes, chunk),)+writer.shape, GREY, dtype="uint8")
+    for start in range(0, nframes, chunk):
+        writer.write(frames[0:min(chunk, nframes-start)])
+
+def concat(fns, out):
+    """Join video files with identical encoding settings, without re-encoding them"""
+    with tempfile.NamedTemporaryFile("w", suffix=".txt", delete=False) as f:
+        for fn in fns:
+            path = os.path.abspath(fn).replace("'", "'\\''")
+            f.write(f"file '{path}'\n")
+        listfn = f.name
+    try:
+        subprocess.run([get_ffmpeg_exe(), "-hide_banner", "-loglevel", "error", "-f", "concat", "-safe", "0",
+                        "-i", listfn, "-c", "copy", out], check=True)
+    finally:
+        os.unlink(listfn)
+
+def write_playlist(fns, out):
+    """Write an ffconcat playlist which plays the video files fns in turn"""
+    with open(out, "w") as f:
+        f.write("ffconcat version 1.0\n")
+        for fn in fns:
+            path = os.path.relpath(fn, os.path.dirname(os.path.abspath(out))).replace("'", "'\\''")
+            f.write(f"file '{path}'\n")
+
+def render_plan(fn, plan, encode, codec="mpeg2"):
+    """Save the video described by a playback plan, encoding each distinct segment once.
+
+    The distinct segments are encoded to temporary files next to fn,
+    which are then joined in playback order by ffmpeg without
+    re-encoding.  So the time taken only grows with the number of
+    distinct frames, not with the number of repetitions.
+
+    If fn ends in .ffconcat, the segment files are kept and fn is an
+    ffconcat playlist of them, which players based on ffmpeg (e.g.
+    ffplay, mpv or PsychoPy's ffpyplayer) play as one video.  The size on
+    disk then does not grow with the number of repetitions either.
+
+    Parameters
+    ----------
+    fn : str
+        The file name of the video
+    plan : list of Segment
+        The segments in playback order, see playback_plan
+    encode : function
+        encode(segment, fn) encodes the frames of one segment as the video
+        file fn, with the codec `codec`
+    codec : str
+        The codec, see zebranoise.video.CODECS
+    """
+    if os.path.exists(fn):
+        raise IOError("Output video file already exists!")
+    playlist = fn.endswith(".ffconcat")
+    if len(plan) == 1 and not playlist:
+        encode(plan[0], fn)
+        return
+    ext = CODECS[codec]['ext']
+    base = os.path.splitext(fn)[0] if playlist or fn.endswith(ext) else fn
+    parts = {seg: f"{base}.part{i}{ext}" for i,seg in enumerate(dict.fromkeys(plan))}
+    done = False
+    try:
+        for seg,partfn in parts.items():
+            encode(seg, partfn)
+        if playlist:
+            write_playlist([parts[seg] for seg in plan], fn)
+        else:
+            concat([parts[seg] for seg in plan], fn)
+        done = True
+    finally:
+        for partfn in parts.values():
+            if os.path.exists(partfn) and not (playlist and done):
+                os.unlink(partfn)
@@ -0,0 +1,175 @@
+import threading
+import time
+import numpy as np
+
+class RealtimeRenderer:
+    """Render frames ahead of a fixed-rate clock, for presenting a stimulus live.
+
+    Instead of encoding a video to be played back later, a background
+    thread renders upcoming frames into a ring buffer, and presentation
+    software pulls each one as it is due with next_frame.  Frame n is due
+    at n/fps seconds after start().  If the caller falls behind, frames
+    whose deadline has passed are skipped, so the stimulus stays in time,
+    and are counted as dropped.  If a frame is not rendered by its
+    deadline, the caller waits for it and it is counted as late.
+
+    Parameters
+    ----------
+    render : function
+        render(t, out) writes frame t into the uint8 (y,x) array out
+    nframes : int > 0
+        The number of frames in the stimulus
+    shape : (int, int)
+        The (y,x) size of each frame
+    fps : float > 0
+        The frame rate
+    prefetch : int > 0
+        The number of frames to render ahead
+    loop : bool
+        Start again from the first frame at the end, rather than stopping
+    close : function, optional
+        close() is called once rendering has stopped, e.g. to release what
+        render uses
+    """
+    def __init__(self, render, nframes, shape, fps, prefetch=8, loop=False, close=None):
+        assert nframes > 0 and fps > 0 and prefetch > 0
+        self.render = render
+        self.nframes = nframes
+        self.fps = fps
+        self.prefetch = prefetch
+        self.loop = loop
+        self.close = close
+        # One more slot than prefetch, for the frame last returned
+        self.nslots = prefetch + 1
+        self.ring = np.zeros((self.nslots,)+tuple(shape), dtype="uint8")
+        self.slots = [-1]*self.nslots # The position held by each slot
+        self.cond = threading.Condition()
+        self.thread = None
+        self.error = None
+        self.stopped = False
+        self.pos = 0 # The next position to present, counting up across loops
+        self.t0 = None
+        self.dropped = []
+        self.late = 0
+        self.max_lateness = 0.0
+        self.presented = 0
+        self.render_time = 0.0
+        self.rendered = 0
+    def __enter__(self):
+        self.start()
+        return self
+    def __exit__(self, *args):
+        self.stop()
+    def __iter__(self):
+        while True:
+            try:
+                yield self.next_frame()
+            except StopIteration:
+                return
+    def _end(self):
+        return np.inf if self.loop else self.nframes
+    def start(self, prime=True):
+        """Start rendering, and start the clock.
+
+        If prime is True, wait until the ring buffer is full first, so the
+        first frames are not late.
+        """
+        assert self.thread is None, "Already started"
+        self.thread = threading.Thread(target=self._producer, daemon=True)
+        self.thread.start()
+        if prime:
+            with self.cond:
+                self.cond.wait_for(lambda : self.error is not None
+                                   or all(self.slots[p % self.nslots] == p for p in range(0, int(min(self.prefetch, self._end())))))
+        self.t0 = time.perf_counter()
+    def stop(self):
+        """Stop the rendering thread"""
+        with self.cond:
+            self.stopped = True
+            self.cond.notify_all()
+        if self.thread is not None:
+            self.thread.join()
+        if self.close is not None:
+            close, self.close = self.close, None
+            close()
+    def _producer(self):
+        p = 0
+        try:
+            while True:
+                with self.cond:
+                    # Wait for a free slot, and skip any frames which the
+                    # consumer has already dropped
+                    self.cond.wait_for(lambda : self.stopped or p < self.pos + self.prefetch)
+                    if self.stopped:
+                        return
+                    p = max(p, self.pos)
+                if p >= self._end():
+                    return
+                t = time.perf_counter()
+                self.render(p % self.nframes, self.ring[p % self.nslots])
+                with self.cond:
+                    self.render_time += time.perf_counter() - t
+                    self.rendered += 1
+                    self.slots[p % self.nslots] = p
+                    self.cond.notify_all()
+                p += 1
+        except BaseException as e:
+            with self.cond:
+                self.error = e
+                self.cond.notify_all()
+    def deadline(self, pos):
+        """The time (on the time.perf_counter clock) at which position pos is due"""
+        return self.t0 + pos/self.fps
+    def next_frame(self, wait=True):
+        """Return the next frame which is due, as (t, frame).
+
+        t is the frame number in the stimulus, and frame is a uint8 (y,x)
+        array in the ring buffer, which is only valid until the next call.
+
+        Parameters
+        ----------
+        wait : bool
+            Sleep until the frame's deadline before returning it.  Pass
+            False if the caller already waits, e.g. for the display's
+            vertical sync.
+
+        Raises StopIteration after the last frame, unless looping.
+        """
+        assert self.t0 is not None, "Call start() first"
+        now = time.perf_counter()
+        # Skip the frames whose time has already passed
+        due = int((now - self.t0)*self.fps)
+        with self.cond:
+            if due > self.pos:
+                self.dropped.extend(p % self.nframes for p in range(self.pos, min(due, self._end())))
+                self.pos = due
+                self.cond.notify_all()
+        if self.pos >= self._end():
+            raise StopIteration
+        pos = self.pos
+        if wait:
+            time.sleep(max(0, self.deadline(pos) - time.perf_counter()))
+        with self.cond:
+            self.cond.wait_for(lambda : self.error is not None or self.slots[pos % self.nslots] == pos)
+            if self.error is not None:
+                raise self.error
+            lateness = time.perf_counter() - self.deadline(pos)
+            if lateness > 1/self.fps:
+                self.late += 1
+            self.max_lateness = max(self.max_lateness, lateness)
+            self.presented += 1
+            # Frees the slot of the previous frame
+            self.pos = pos + 1
+            self.cond.notify_all()
+        return pos % self.nframes, self.ring[pos % self.nslots]
+    def report(self):
+        """Counts of frames presented, dropped and late, and rendering times.
+
+        A frame is late if it was returned more than one frame interval
+        after its deadline.  "dropped_frames" lists the frame numbers which
+        were skipped.
+        """
+        with self.cond:
+            return dict(presented=self.presented, dropped=len(self.dropped), late=self.late,
+                        dropped_frames=list(self.dropped), max_lateness_s=self.max_lateness,
+                        render_s_per_frame=self.render_time/max(self.rendered, 1))
@@ -0,0 +1,113 @@
+import os
+from collections import OrderedDict
+import numpy as np
+
+from . import _perlin
+from .cache import FrameCache
+from .stats import StreamingStats
+from .util import can_fuse, filter_frames_index_function, split_overlays, apply_overlays
+
+class FrameServer:
+    """Serve single filtered frames of a stimulus on demand, e.g. for closed-loop experiments.
+
+    Frames are served from the stimulus's cache if it has been generated, and
+    are otherwise generated one at a time from its PerlinStream, which keeps
+    the per-axis lattice between calls.  Either way, only the requested frame
+    is computed, and the last few frames are kept in an LRU cache.
+
+    Without a cache, the statistics used for normalisation (and the spatial
+    mean, if demeaning across space) are estimated from a sample of evenly
+    spaced frames.  Values beyond the estimated range are clipped.
+
+    Parameters
+    ----------
+    stim : PerlinStimulus
+        The stimulus to serve
+    filters : list of str and/or (str, ...) tuples
+        The filters to apply, as for save_video
+    lru_size : int >= 0
+        The number of recent frames to keep
+    calibration_frames : int > 0
+        The number of frames used to estimate the statistics without a cache
+
+    The server keeps the cache open until close() is called, or the end of
+    a `with` block.
+    """
+    def __init__(self, stim, filters=[], lru_size=16, calibration_frames=32):
+        self.stim = stim
+        self.filters = filters
+        self.noise_filters, self.overlays = split_overlays(filters)
+        self.lru_size = lru_size
+        self.lru = OrderedDict()
+        self.fused = can_fuse(self.noise_filters, postprocess=True)
+        self.index = filter_frames_index_function(filters, stim.size[2])
+        self.shape = (stim.size[1], stim.size[0])
+        self.cache = None
+        # The cache subtracts its own spatial mean, see FrameCache.read
+        self.mean = None
+        self.buf = np.empty((1,)+self.shape, dtype="float32")
+        fn = stim.cache_filename()
+        cache = FrameCache(fn) if os.path.isfile(fn) else None
+        if cache is not None and cache.complete:
+            stim.generate_batch() # Only loads the statistics
+            self.cache = cache
+            self.min_, self.max_ = stim.min_, stim.max_
+        else:
+            if cache is not None:
+                cache.close()
+            self._calibrate(calibration_frames)
+    def _calibrate(self, n):
+        stats = StreamingStats(self.shape)
+        for t in np.linspace(0, self.stim.size[2]-1, n).astype(int):
+            stats.update(self._generate(t))
+        self.mean = stats.mean() if self.stim.demean in ["both", "space"] else None
+        self.min_, self.max_ = stats.bounds(self.mean)
+    def _generate(self, t):
+        """The (1,y,x) frame t, before subtracting any spatial mean"""
+        frame = self.stim.stream().frames(int(t), out=self.buf)
+        if self.stim.demean in ["both", "time"]:
+            frame -= np.mean(frame)
+        return frame
+    def close(self):
+        """Release the cache, if frames are served from one.  It is safe to call this again.
+
+        The frames can no longer be served from the cache afterwards.
+        """
+        if self.cache is not None:
+            self.cache.close()
+    def __enter__(self):
+        return self
+    def __exit__(self, *args):
+        self.close()
+    def __len__(self):
+        return self.stim.size[2]
+    def __getitem__(self, t):
+        return self.get(t)
+    def get(self, t):
+        """Return frame t of the filtered stimulus as a (y,x) uint8 array.
+
+        The returned array is shared with the LRU cache, so do not modify it.
+        """
+        if not 0 <= t < len(self):
+            raise IndexError("Frame out of range")
+        if t in self.lru:
+            self.lru.move_to_end(t)
+            return self.lru[t]
+        frame = self._render(self.index(t))
+        if self.lru_size > 0:
+            self.lru[t] = frame
+            if len(self.lru) > self.lru_size:
+                self.lru.popitem(last=False)
+        return frame
+    def _render(self, i):
+        if self.cache is not None and self.fused:
+            frames = _perlin.postprocess(self.cache.frames[i:i+1], filters=self.noise_filters, norm=self.cache.raw_range(self.min_, self.max_), mean=self.cache.raw_mean())
+            return apply_overlays(frames, self.overlays, i)[0]
+        data = self.cache.read(i) if self.cache is not None else self._generate(i)
+        if self.fused:
+            frames = _perlin.postprocess(data, filters=self.noise_filters, norm=(self.min_, self.max_), mean=self.mean)
+            return apply_overlays(frames, self.overlays, i)[0]
+        if self.mean is not None and self.cache is None:
+            data = data - self.mean[None,:,:]
+        data = self.stim._filter_batch(np.moveaxis(data, 0, 2), self.filters, i, norm=(self.min_, self.max_))
+        return data[:,:,0]
@@ -0,0 +1,88 @@
+import numpy as np
+
+class StreamingStats:
+    """Statistics of a noise movie, accumulated one batch of frames at a time.
+
+    Keeps the per-pixel sum, min and max over time, and optionally a
+    histogram of all values.  From these, the per-pixel (spatial) mean and
+    the exact global min and max after subtracting it can be found without
+    a second pass over the frames.
+
+    Parameters
+    ----------
+    shape : tuple of int
+        The (y,x) shape of each frame
+    bins : int or None
+        If given, also keep a histogram of the values with this many bins
+        over `hist_range`
+    hist_range : (float, float)
+        The range of the histogram.  Values outside it are counted in the
+        first or last bin.
+    """
+    def __init__(self, shape, bins=None, hist_range=(-2, 2)):
+        self.shape = tuple(shape)
+        self.count = 0
+        self.sum = np.zeros(self.shape, dtype="float64")
+        self.pixmin = np.full(self.shape, np.inf, dtype="float32")
+        self.pixmax = np.full(self.shape, -np.inf, dtype="float32")
+        self.hist_range = hist_range
+        self.hist = np.zeros(bins, dtype="int64") if bins else None
+    def update(self, frames):
+        """Add a (t,y,x) batch of frames."""
+        assert frames.shape[1:] == self.shape, "Wrong frame size"
+        self.count += frames.shape[0]
+        self.sum += np.sum(frames, axis=0, dtype="float64")
+        np.minimum(self.pixmin, np.min(frames, axis=0), out=self.pixmin)
+        np.maximum(self.pixmax, np.max(frames, axis=0), out=self.pixmax)
+        if self.hist is not None:
+            lo, hi = self.hist_range
+            self.hist += np.histogram(np.clip(frames, lo, hi), bins=len(self.hist), range=(lo, hi))[0]
+    def merge(self, other):
+        """Add the statistics of another set of frames of the same size."""
+        assert other.shape == self.shape, "Wrong frame size"
+        self.count += other.count
+        self.sum += other.sum
+        np.minimum(self.pixmin, other.pixmin, out=self.pixmin)
+        np.maximum(self.pixmax, other.pixmax, out=self.pixmax)
+        if self.hist is not None:
+            assert other.hist is not None and len(other.hist) == len(self.hist) and other.hist_range == self.hist_range, "Histograms must match"
+            self.hist += other.hist
+    def save(self, fn):
+        """Save the statistics to a .npz file, e.g. to merge them elsewhere."""
+        np.savez(fn, count=self.count, sum=self.sum, pixmin=self.pixmin, pixmax=self.pixmax,
+                 hist_range=np.asarray(self.hist_range, dtype="float64"),
+                 hist=self.hist if self.hist is not None else np.zeros(0, dtype="int64"))
+    @classmethod
+    def load(cls, fn):
+        """Load statistics saved with save()."""
+        with np.load(fn) as f:
+            stats = cls(f['sum'].shape, bins=len(f['hist']) or None, hist_range=tuple(f['hist_range']))
+            stats.count = int(f['count'])
+            stats.sum[:] = f['sum']
+            stats.pixmin[:] = f['pixmin']
+            stats.pixmax[:] = f['pixmax']
+            if stats.hist is not None:
+                stats.hist[:] = f['hist']
+        return stats
+    def mean(self):
+        """The per-pixel mean across time, as float32"""
+        return (self.sum/max(self.count, 1)).astype("float32")
+    def bounds(self, mean=None):
+        """The global min and max, after optionally subtracting a per-pixel mean.
+
+        This is exact, since each pixel has a fixed mean subtracted from it.
+        """
+        if mean is None:
+            return float(np.min(self.pixmin)), float(np.max(self.pixmax))
+        return float(np.min(self.pixmin - mean)), float(np.max(self.pixmax - mean))
+    def percentile(self, q):
+        """Approximate percentile(s) q ∈ [0,100] of the values, from the histogram.
+
+        These are of the values passed to update(), i.e. without subtracting
+        any per-pixel mean afterwards.
+        """
+        assert self.hist is not None, "No histogram was kept"
+        lo, hi = self.hist_range
+        edges = np.linspace(lo, hi, len(self.hist)+1)
+        cdf = np.concatenate([[0], np.cumsum(self.hist)])/max(np.sum(self.hist), 1)
+        return np.interp(np.asarray(q)/100, cdf, edges)
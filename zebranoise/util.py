@@ -1,9 +1,14 @@
+import functools
+import os
 import numpy as np
-import scipy.ndimage
 from . import _perlin
 
 XYSCALEBASE = 100
 
+# With method="incremental", octaves whose lattice cells last at least
+# this many frames are computed incrementally
+COARSE_FRAMES = 8
+
 def filter_frames(im, filt, *args):
     """Apply a filter/transformation to an image batch
 
@@ -32,7 +37,9 @@ def filter_frames(im, filt, *args):
     if filt == "reverse":
         return im # We need to use filter_index_function for this
     if filt == "blur":
-        return np.asarray([scipy.ndimage.filters.gaussian_filter(im.astype(np.float32)[:,:,i], args[0], mode='wrap') for i in range(0, im.shape[2])]).transpose([1,2,0])
+        # Blurred in place on a single (t,y,x) float32 copy
+        frames = np.moveaxis(im, 2, 0).astype(np.float32, order="C")
+        return np.moveaxis(_perlin.blur(frames, args[0]), 0, 2)
     if filt == "wood":
         return (im % args[0]) / args[0]
     if filt == "center":
@@ -79,8 +86,145 @@ def filter_frames(im, filt, *args):
     raise ValueError("Invalid filter specified")
 
 
-def apply_filters(arr, filters):
+# Filters which the C implementation can apply while generating or
+# post-processing the noise, see _perlin.make_perlin.  Blurs need whole
+# frames, so they can only be applied by _perlin.postprocess.
+FUSED_FILTERS = ["threshold", "softthresh", "comb", "invert", "wood", "center", "reverse"]
+POSTPROCESS_FILTERS = FUSED_FILTERS + ["blur"]
+
+def filter_name(f):
+    """The name of a filter given as a str or (str, ...) tuple, or None for a callable filter"""
+    return f if isinstance(f, str) else (None if callable(f) else f[0])
+
+def can_fuse(filters, postprocess=False):
+    """Whether all of the filters can be applied in C instead of filter_frames
+
+    If postprocess is True, check for _perlin.postprocess rather than for
+    generating the noise.
+    """
+    allowed = POSTPROCESS_FILTERS if postprocess else FUSED_FILTERS
+    for f in filters:
+        n = filter_name(f)
+        if n not in allowed:
+            return False
+    return True
+
+
+# Filters which draw a marker, e.g. for a photodiode, over part of each
+# frame.  When saving or serving frames, those after all of the filters
+# which change pixel values are drawn by apply_overlays into the final
+# uint8 frames in place.
+OVERLAY_FILTERS = ["photodiode", "photodiode_anywhere", "photodiode_b2", "photodiode_fusi", "photodiode_bscope", "photodiode_ibl"]
+
+def split_overlays(filters):
+    """Split filters into the (filters, overlays) to apply before and after discretizing.
+
+    Only the overlays which come after every other filter (apart from
+    "reverse") are split off.  Earlier ones are changed by the filters
+    after them, e.g. "invert", so they stay in place in filters and are
+    drawn on the float frames by apply_filters.
+    """
+    pixel = [i for i,f in enumerate(filters) if filter_name(f) not in OVERLAY_FILTERS + ["reverse"]]
+    tail = pixel[-1]+1 if pixel else 0
+    return (list(filters[:tail]) + [f for f in filters[tail:] if filter_name(f) not in OVERLAY_FILTERS],
+            [f for f in filters[tail:] if filter_name(f) in OVERLAY_FILTERS])
+
+@functools.lru_cache(maxsize=1)
+def _ibl_sequence():
+    """The default marker sequence of photodiode_ibl, 0 or 1 for each frame"""
+    seq = np.random.RandomState(1234).random_sample(3600)
+    seq = np.tile(seq, (8,1)).T.flatten() > .5
+    seq.setflags(write=False)
+    return seq
+
+def overlay_marker(f, start, stop):
+    """The patch drawn by an overlay filter, and its value in frames start to stop-1.
+
+    Returns
+    -------
+    (slice, slice, ndarray)
+        The rows and columns of the patch, and its uint8 value in each frame
+    """
+    n = f if isinstance(f, str) else f[0]
+    args = [] if isinstance(f, str) else f[1:]
+    if n == "photodiode_ibl":
+        s = 75
+        seq = _ibl_sequence() if len(args) == 0 else np.asarray(args[0])
+        if stop > len(seq):
+            raise ValueError("The photodiode_ibl sequence is shorter than the stimulus")
+        return slice(-s, None), slice(-s, None), (seq[start:stop] != 0).astype(np.uint8)*255
+    # Black on even frames, white on odd frames
+    values = (np.arange(start, stop) % 2).astype(np.uint8)*255
+    if n == "photodiode":
+        s = args[0]
+        return slice(0, s), slice(-s, None), values
+    if n == "photodiode_anywhere":
+        x, y, s = args
+        return slice(y, y+s), slice(x, x+s), values
+    if n == "photodiode_b2":
+        return slice(0, 125), slice(-125, None), values
+    if n == "photodiode_fusi":
+        return slice(0, 75), slice(-75, None), values
+    if n == "photodiode_bscope":
+        return slice(-100, None), slice(0, 100), values
+    raise ValueError("Invalid overlay filter specified")
+
+def _crop_slice(s, offset, length, size):
+    """The part of slice s of an axis of length size within offset to offset+length-1, relative to offset"""
+    lo, hi, _ = s.indices(size)
+    lo, hi = max(lo, offset), min(hi, offset+length)
+    return slice(lo-offset, hi-offset) if lo < hi else None
+
+def apply_overlays(frames, overlays, start, roi=None, size=None):
+    """Draw the markers of overlay filters into uint8 frames in place.
+
+    Only the marker patches are written, so no copy of the frames is made.
+
+    Parameters
+    ----------
+    frames : 3D uint8 ndarray
+        The frames, in (t,y,x) order
+    overlays : list of str and/or (str, ...) tuples
+        Filters from OVERLAY_FILTERS
+    start : int
+        The index of the first frame in the stimulus, which determines the
+        value of the markers
+    roi : (int, int, int, int), optional
+        If the frames are a region of interest (x0, y0, width, height) of
+        the full frames, only the part of each marker inside it is drawn
+    size : (int, int)
+        The (xsize, ysize) of the full frames, needed with roi
+    """
+    for f in overlays:
+        ys, xs, values = _marker(f, start, start+len(frames), roi, size)
+        if ys is not None:
+            frames[:,ys,xs] = values[:,None,None]
+    return frames
+
+def _marker(f, start, stop, roi, size):
+    """overlay_marker, with the patch cropped to the region of interest roi if given"""
+    ys, xs, values = overlay_marker(f, start, stop)
+    if roi is not None:
+        ys = _crop_slice(ys, roi[1], roi[3], size[1])
+        xs = _crop_slice(xs, roi[0], roi[2], size[0])
+        if ys is None or xs is None:
+            return None, None, values
+    return ys, xs, values
+
+def apply_filters(arr, filters, start=0, roi=None, size=None):
+    """Apply filters in turn to float frames in (y,x,t) order.
+
+    Overlay filters draw their marker as for apply_overlays, with the
+    value for frame start+i of the stimulus in frame i, and roi and size
+    as for apply_overlays.
+    """
     for f in filters:
+        if filter_name(f) in OVERLAY_FILTERS:
+            ys, xs, values = _marker(f, start, start+arr.shape[2], roi, size)
+            arr = arr.copy()
+            if ys is not None:
+                arr[ys,xs,:] = values/np.float32(255)
+            continue
         if isinstance(f, str):
             n = f
             args = []
@@ -137,22 +281,208 @@ def discretize(im):
     ret = im.astype(np.uint8)
     return ret
 
-def generate_frames(xsize, ysize, tsize, timepoints, levels=10, xyscale=.5, tscale=1, xscale=1.0, yscale=1.0, fps=30, seed=0):
-    """Preprocess arguments before passing to the C implementation of Perlin noise.
-    """
+def available_memory():
+    """The amount of memory available to allocate, in bytes, or None if unknown"""
+    try:
+        import psutil
+        return psutil.virtual_memory().available
+    except ImportError:
+        pass
+    try:
+        # Linux, including memory which can be reclaimed from the page cache
+        with open("/proc/meminfo") as f:
+            for line in f:
+                if line.startswith("MemAvailable:"):
+                    return int(line.split()[1])*1024
+    except (OSError, ValueError):
+        pass
+    try:
+        return os.sysconf("SC_AVPHYS_PAGES")*os.sysconf("SC_PAGE_SIZE")
+    except (AttributeError, ValueError, OSError):
+        return None
+
+def _perlin_args(xsize, ysize, tsize, levels, xyscale, tscale, xscale, yscale, fps, seed):
+    """The x, y and full t axes, and keyword arguments, for the C implementation."""
     # Use the temporal scale and number of timepoints to compute how many
     # units to make the stimulus across the temporal dimension
     tunits = int(tsize/(tscale*(fps/30)))
     ts_all = np.arange(0, tsize, dtype="float32")/(tscale*(fps/30))
     ratio = int(xsize/ysize*XYSCALEBASE)
-    arr = _perlin.make_perlin(np.arange(0, xsize, dtype="float32")/ysize/xscale, # Yes, divide by y size
-                              np.arange(0, ysize, dtype="float32")/ysize/yscale,
-                              ts_all[timepoints],
-                              octaves=levels,
-                              persistence=xyscale,
-                              repeatx=ratio,
-                              repeaty=XYSCALEBASE,
-                              repeatz=tunits,
-                              base=seed)
-    arr = arr.swapaxes(0,1)
+    xs = np.arange(0, xsize, dtype="float32")/ysize/xscale # Yes, divide by y size
+    ys = np.arange(0, ysize, dtype="float32")/ysize/yscale
+    kwargs = dict(octaves=levels,
+                  persistence=xyscale,
+                  repeatx=ratio,
+                  repeaty=XYSCALEBASE,
+                  repeatz=tunits,
+                  base=seed)
+    return xs, ys, ts_all, kwargs
+
+def tiles(xsize, ysize, columns=1, rows=1):
+    """Split frames into a grid of regions of interest.
+
+    For example, tiles(5760, 1080, columns=3) gives the part of a stimulus
+    shown on each of three 1920x1080 monitors side by side.  Each tile
+    can be generated independently by passing it as `roi`, e.g. to
+    generate_frames, and the tiles put together are identical to the
+    full frames.
+
+    Returns
+    -------
+    list of (int, int, int, int)
+        The (x0, y0, width, height) of each tile, row by row.  If the
+        frame size is not a multiple of the grid, the tiles differ in size
+        by at most one pixel.
+    """
+    assert 1 <= columns <= xsize and 1 <= rows <= ysize
+    xe = [xsize*i//columns for i in range(0, columns+1)]
+    ye = [ysize*i//rows for i in range(0, rows+1)]
+    return [(xe[i], ye[j], xe[i+1]-xe[i], ye[j+1]-ye[j]) for j in range(0, rows) for i in range(0, columns)]
+
+def _crop(xs, ys, roi):
+    """The x and y axes of the region of interest (x0, y0, width, height)"""
+    if roi is None:
+        return xs, ys
+    x0, y0, w, h = roi
+    if x0 < 0 or y0 < 0 or w <= 0 or h <= 0 or x0+w > len(xs) or y0+h > len(ys):
+        raise ValueError("Region of interest must lie within the frame")
+    return xs[x0:x0+w], ys[y0:y0+h]
+
+def common_prefix(tsize_a, tsize_b, levels, xyscale, tscale, fps):
+    """The number of leading frames which are identical in two movies of different lengths.
+
+    The movies must have the same parameters apart from their number of
+    frames, tsize_a and tsize_b.  The noise is periodic in time over the
+    whole movie, so the frames in the last lattice cell of each octave
+    blend back towards the first frame, and differ between the movies.
+    The frames before that are computed identically.  This follows
+    lattice_axis_fill in _perlin.c.
+    """
+    n = min(tsize_a, tsize_b)
+    ts = np.arange(0, n, dtype="float32")/(tscale*(fps/30))
+    repeats = [int(t/(tscale*(fps/30))) for t in (tsize_a, tsize_b)]
+    # The octave schedule of lattice_build
+    freq, amp, nlevels = np.float32(1), np.float32(1), 0
+    for l in range(0, levels):
+        nlevels += 1
+        amp = np.float32(amp*np.float32(xyscale))
+        if amp < .004:
+            break
+    same = np.ones(n, dtype=bool)
+    for l in range(0, nlevels):
+        cell = (ts*freq).astype(int) + 1
+        ra, rb = (int(np.float32(r)*freq) for r in repeats)
+        same &= (cell % ra) == (cell % rb)
+        freq = np.float32(freq*2)
+    return int(np.argmin(same)) if not np.all(same) else n
+
+def generate_frames(xsize, ysize, tsize, timepoints, levels=10, xyscale=.5, tscale=1, xscale=1.0, yscale=1.0, fps=30, seed=0, threads=0, layout="yxt", out=None, backend="cpu", roi=None):
+    """Preprocess arguments before passing to the C implementation of Perlin noise.
+
+    `threads` is the number of worker threads used by the C implementation,
+    or 0 to use all available cores.
+
+    `layout` gives the axis order of the returned frames.  The default,
+    "yxt", is a (non-contiguous) view with time as the last axis.  With
+    "tyx", the result is C-contiguous with one (y,x) frame per timepoint,
+    so each frame can be passed on without copying.
+
+    `out`, if given, is a writable C-contiguous float32 or uint8 array of
+    shape (len(timepoints), ysize, xsize) which the frames are written into
+    in place.  It requires the "tyx" layout.  See _perlin.make_perlin for how
+    uint8 values are scaled.
+
+    `backend` is "cpu" for the C extension or "gpu" for zebranoise.gpu,
+    which gives the same output.
+
+    `roi`, if given, is a region of interest (x0, y0, width, height) of
+    the frames.  Only the pixels x0 to x0+width-1 and y0 to y0+height-1
+    are generated, and they are identical to those of the full frames, so
+    `out` and the result have width and height in place of xsize and
+    ysize.  See tiles.
+    """
+    assert layout in ["yxt", "tyx"]
+    assert backend in ["cpu", "gpu"]
+    assert out is None or layout == "tyx", "out requires the tyx layout"
+    xs, ys, ts_all, kwargs = _perlin_args(xsize, ysize, tsize, levels, xyscale, tscale, xscale, yscale, fps, seed)
+    xs, ys = _crop(xs, ys, roi)
+    make_perlin = _perlin.make_perlin if backend == "cpu" else _gpu().make_perlin
+    arr = make_perlin(xs, ys, ts_all[timepoints], threads=threads,
+                              layout="zyx" if layout == "tyx" else "xyz", out=out, **kwargs)
+    if layout == "yxt":
+        arr = arr.swapaxes(0,1)
     return arr
+
+def generate_frames_batch(xsize, ysize, tsize, timepoints, seeds=[0], xyscales=[.5], levels=10, tscale=1, xscale=1.0, yscale=1.0, fps=30, threads=0, out=None, roi=None):
+    """Generate the same frames of several variants of the noise at once.
+
+    Variant i has seed seeds[i] and xyscale xyscales[i], and either list
+    may have a single element to use it for every variant.  The other
+    arguments are as for generate_frames.  The result is a C-contiguous
+    float32 array of shape (variants, len(timepoints), ysize, xsize), and
+    each variant is identical to generate_frames(..., layout="tyx").
+
+    The variants are computed together in a single pass over the grid by
+    _perlin.make_perlin_batch.  Variants with the same seed share the
+    evaluation of each octave, so extra xyscales are cheap.  Variants with
+    different seeds share no work, so they are no faster than calling
+    generate_frames for each.
+
+    `out`, if given, is a writable C-contiguous float32 or uint8 array of
+    the output shape which the frames are written into in place.  `roi`
+    restricts the frames to a region of interest, as for generate_frames.
+    """
+    xs, ys, ts_all, kwargs = _perlin_args(xsize, ysize, tsize, levels, 0, tscale, xscale, yscale, fps, 0)
+    xs, ys = _crop(xs, ys, roi)
+    del kwargs['persistence'], kwargs['base']
+    return _perlin.make_perlin_batch(xs, ys, ts_all[timepoints], list(seeds), list(xyscales), threads=threads,
+                                     layout="zyx", out=out, **kwargs)
+
+def frame_stream(xsize, ysize, tsize, levels=10, xyscale=.5, tscale=1, xscale=1.0, yscale=1.0, fps=30, seed=0, threads=0, backend="cpu", method="exact", roi=None):
+    """Create a _perlin.PerlinStream over the whole movie.
+
+    Takes the same arguments as generate_frames.  The returned stream
+    computes the grid once and then generates any range of frames with
+    `stream.frames(start, stop)`, as a contiguous (t,y,x) float32 array
+    identical to `generate_frames(..., layout="tyx")`.  Iterating over it
+    yields each (y,x) frame in turn.
+
+    With backend="gpu", this is a zebranoise.gpu.GPUStream instead, whose
+    frames method can also leave the frames on the device.
+
+    With method="multires", this is a zebranoise.multires.MultiresStream,
+    which evaluates the coarse octaves on coarser grids.  With
+    method="incremental", the octaves which change slowly in time are
+    computed incrementally from one frame to the next, which is exact up to
+    float rounding.  See coarse_frames in _perlin.PerlinStream.  With
+    method="fixed", the noise is computed in 16-bit fixed point, which is
+    faster for large frames and within 1.4e-3 of the exact noise.  See
+    precision in _perlin.make_perlin.
+
+    With a region of interest `roi`, the stream only generates that part
+    of each frame, as for generate_frames.  Every method gives the same
+    pixels as it does in the full frames.
+    """
+    assert backend in ["cpu", "gpu"]
+    assert method in ["exact", "multires", "incremental", "fixed"]
+    xs, ys, ts_all, kwargs = _perlin_args(xsize, ysize, tsize, levels, xyscale, tscale, xscale, yscale, fps, seed)
+    if method == "multires":
+        assert backend == "cpu", "The multires method only runs on the CPU"
+        from .multires import MultiresStream
+        # The coarse grids are placed relative to the full frame
+        _crop(xs, ys, roi)
+        return MultiresStream(xs, ys, ts_all, threads=threads, roi=roi, **kwargs)
+    xs, ys = _crop(xs, ys, roi)
+    if backend == "gpu":
+        assert method == "exact", "The GPU backend only supports the exact method"
+        return _gpu().GPUStream(xs, ys, ts_all, threads=threads, **kwargs)
+    if method == "incremental":
+        kwargs['coarse_frames'] = COARSE_FRAMES
+    if method == "fixed":
+        kwargs['precision'] = "fixed16"
+    return _perlin.PerlinStream(xs, ys, ts_all, threads=threads, **kwargs)
+
+def _gpu():
+    # Imported on demand, so CuPy is only loaded if it is used
+    from . import gpu
+    return gpu
@@ -0,0 +1,113 @@
+import subprocess
+from pathlib import Path
+import numpy as np
+from imageio_ffmpeg import get_ffmpeg_exe
+
+# The ffmpeg options for each codec.  "input" go before the input and
+# "output" after it, with {bitrate} replaced by the bitrate.  The frames
+# are always piped in as 8-bit greyscale.  Codecs which can store
+# greyscale do so, which keeps the full 0-255 range, and the others
+# convert it to the 4:2:0 pixel format their encoder takes.
+CODECS = {
+    "mpeg2": dict(ext=".mp4", output=["-c:v", "mpeg2video", "-b:v", "{bitrate}M"]),
+    "h264": dict(ext=".mp4", output=["-c:v", "libx264", "-preset", "fast", "-b:v", "{bitrate}M", "-pix_fmt", "yuv420p"]),
+    "hevc": dict(ext=".mp4", output=["-c:v", "libx265", "-preset", "fast", "-b:v", "{bitrate}M", "-pix_fmt", "yuv420p", "-tag:v", "hvc1"]),
+    "h264_nvenc": dict(ext=".mp4", output=["-c:v", "h264_nvenc", "-preset", "p4", "-b:v", "{bitrate}M", "-pix_fmt", "yuv420p"]),
+    "hevc_nvenc": dict(ext=".mp4", output=["-c:v", "hevc_nvenc", "-preset", "p4", "-b:v", "{bitrate}M", "-pix_fmt", "yuv420p", "-tag:v", "hvc1"]),
+    "h264_qsv": dict(ext=".mp4", output=["-c:v", "h264_qsv", "-b:v", "{bitrate}M", "-pix_fmt", "nv12"]),
+    "hevc_qsv": dict(ext=".mp4", output=["-c:v", "hevc_qsv", "-b:v", "{bitrate}M", "-pix_fmt", "nv12", "-tag:v", "hvc1"]),
+    "h264_vaapi": dict(ext=".mp4", input=["-vaapi_device", "/dev/dri/renderD128"],
+                       output=["-vf", "format=nv12,hwupload", "-c:v", "h264_vaapi", "-b:v", "{bitrate}M"]),
+    "hevc_vaapi": dict(ext=".mp4", input=["-vaapi_device", "/dev/dri/renderD128"],
+                       output=["-vf", "format=nv12,hwupload", "-c:v", "hevc_vaapi", "-b:v", "{bitrate}M", "-tag:v", "hvc1"]),
+    # Lossless
+    "ffv1": dict(ext=".mkv", output=["-c:v", "ffv1", "-level", "3", "-pix_fmt", "gray"]),
+    "x264_lossless": dict(ext=".mp4", output=["-c:v", "libx264", "-preset", "ultrafast", "-qp", "0", "-pix_fmt", "gray"]),
+}
+
+def available_codecs():
+    """The codecs in CODECS whose encoder is built into ffmpeg.
+
+    Hardware encoders are listed if ffmpeg supports them, even if there
+    is no device to run them on.
+    """
+    out = subprocess.run([get_ffmpeg_exe(), "-hide_banner", "-encoders"], capture_output=True, text=True).stdout
+    encoders = {line.split()[1] for line in out.splitlines() if len(line.split()) > 1}
+    return [name for name,c in CODECS.items() if c['output'][c['output'].index("-c:v")+1] in encoders]
+
+def video_filename(fn, codec="mpeg2"):
+    """Add the file extension of the codec's container to fn, unless it already has it"""
+    ext = CODECS[codec]['ext']
+    return fn if fn.endswith(ext) else fn + ext
+
+class VideoWriter:
+    """Encode greyscale uint8 frames by piping them to ffmpeg.
+
+    Frames are written to ffmpeg's stdin as raw video, so no temporary image
+    files are needed and encoding runs alongside frame generation.  Use as
+    a context manager, or call close() when done.
+
+    Parameters
+    ----------
+    fn : str
+        The file name to save the video.  It must not already exist.
+    xsize, ysize : int > 0
+        The dimensions of each frame
+    fps : int > 0
+        Frames per second
+    bitrate : int > 0
+        The bitrate in megabits per second.  Ignored by lossless codecs.
+    codec : str
+        One of CODECS.  The hardware encoders (nvenc, qsv, vaapi) need a
+        suitable GPU and an ffmpeg built with them, and ffv1 needs a .mkv
+        file.
+    threads : int >= 0
+        The number of encoder threads, or 0 for ffmpeg's default
+    """
+    def __init__(self, fn, xsize, ysize, fps, bitrate=20, codec="mpeg2", threads=0):
+        if Path(fn).exists():
+            raise IOError("Output video file already exists!")
+        if codec not in CODECS:
+            raise ValueError(f"Unknown codec {codec}, must be one of {list(CODECS)}")
+        assert threads >= 0
+        self.shape = (ysize, xsize)
+        self.codec = codec
+        spec = CODECS[codec]
+        output = [a.format(bitrate=bitrate) for a in spec['output']]
+        if threads > 0:
+            output += ["-threads", str(threads)]
+        self.proc = subprocess.Popen([get_ffmpeg_exe(), *spec.get('input', []), "-f", "rawvideo", "-pix_fmt", "gray",
+                                      "-s", f"{xsize}x{ysize}", "-r", str(fps), "-i", "-",
+                                      *output, "-an", fn],
+                                     stdin=subprocess.PIPE)
+    def write(self, frames):
+        """Write a (y,x) frame or a (t,y,x) batch of frames.
+
+        C-contiguous uint8 arrays are passed to ffmpeg without copying.
+        """
+        frames = np.ascontiguousarray(frames, dtype=np.uint8)
+        assert frames.shape[-2:] == self.shape, "Wrong frame size"
+        try:
+            self.proc.stdin.write(frames.data)
+        except BrokenPipeError:
+            raise RuntimeError(f"ffmpeg exited early, check that the {self.codec} encoder is available") from None
+    def close(self):
+        """Finish encoding and wait for ffmpeg to exit."""
+        if self.proc.stdin.closed:
+            return
+        self.proc.stdin.close()
+        if self.proc.wait() != 0:
+            raise RuntimeError(f"ffmpeg exited with status {self.proc.returncode}")
+    def __enter__(self):
+        return self
+    def __exit__(self, exc_type, *args):
+        if exc_type is not None:
+            # Don't leave a half-written video behind looking complete
+            self.proc.kill()
+            try:
+                self.proc.stdin.close()
+            except BrokenPipeError:
+                pass
+            self.proc.wait()
+            return
+        self.close()